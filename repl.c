@@ -1,15 +1,39 @@
 // repl.c
+#define _GNU_SOURCE /* O_DIRECT */
+#define _FILE_OFFSET_BITS 64
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <inttypes.h>
+#ifdef _WIN32
 #include <io.h>
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#endif
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -18,7 +42,7 @@
 
 typedef struct
 {
-    uint32_t id;
+    uint64_t id;
     char username[COLUMN_USERNAME_SIZE + 1];
     char email[COLUMN_EMAIL_SIZE + 1];
 } row;
@@ -32,50 +56,147 @@ typedef struct
 #define EMAIL_OFFSET (USERNAME_OFFSET + USERNAME_SIZE)
 #define ROW_SIZE (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
 
-#define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 100
+/* chosen when a database is created and recorded in its header */
+#define PAGE_SIZE_DEFAULT 4096
+#define PAGE_SIZE_MIN 4096
+#define PAGE_SIZE_MAX 65536
+/* pages kept in memory at once; the file itself can grow past this */
+#define PAGER_CACHE_PAGES 1024
+#define PAGER_HASH_BITS 11
+#define PAGER_HASH_BUCKETS (1 << PAGER_HASH_BITS)
+/* most adjacent dirty pages written by one pwritev call */
+#define PAGER_FLUSH_MAX_IOVECS 64
+/* background writer: most pages per batch, time between batches, and the
+   default share of the cache that may be dirty before inserts wait */
+#define PAGEWRITER_BATCH 64
+#define PAGEWRITER_TICK_SECONDS 0.01
+#define PAGEWRITER_HIGH_WATER_DEFAULT 50
+/* shared cache (--shared): pages in the -shm file, and how many changed page
+   numbers are kept for processes that have not caught up yet */
+#define SHARED_CACHE_PAGES 4096
+#define SHARED_HASH_BITS 13
+#define SHARED_HASH_BUCKETS (1 << SHARED_HASH_BITS)
+#define SHARED_CHANGE_LOG 4096
+#define SHARED_MAGIC "MYDBSHM1"
+#define SHARED_MAGIC_SIZE 8
+/* bytes of the -shm file locked with fcntl */
+#define SHARED_LOCK_OPEN 0
+#define SHARED_LOCK_PENDING 1
+#define SHARED_LOCK_STATEMENT 2
+
+/* Row cache: a count-min sketch of ROWCACHE_SKETCH_DEPTH rows of 4-bit
+   counters, halved every ROWCACHE_SAMPLE_FACTOR * capacity lookups */
+#define ROWCACHE_SKETCH_DEPTH 4
+#define ROWCACHE_COUNTER_MAX 15
+#define ROWCACHE_SAMPLE_FACTOR 10
+
+/* File header, stored in page 0. Version 1 had 64-bit keys, page numbers and
+   file offsets; version 2 adds the write generation used by backups; version
+   3 lets the page size vary and has every leaf record its capacity. */
+#define DB_FILE_MAGIC "MYDBFILE"
+#define DB_FORMAT_VERSION 4
+#define HEADER_MAGIC_SIZE 8
+#define HEADER_MAGIC_OFFSET 0
+#define HEADER_VERSION_SIZE sizeof(uint32_t)
+#define HEADER_VERSION_OFFSET (HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE)
+#define HEADER_PAGE_SIZE_SIZE sizeof(uint32_t)
+#define HEADER_PAGE_SIZE_OFFSET (HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE)
+#define HEADER_ROOT_PAGE_SIZE sizeof(uint64_t)
+#define HEADER_ROOT_PAGE_OFFSET (HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE)
+#define HEADER_GENERATION_SIZE sizeof(uint64_t)
+#define HEADER_GENERATION_OFFSET (HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE)
+/* 0 for an unsharded database; otherwise every shard file records the count and its own index */
+#define HEADER_SHARD_COUNT_SIZE sizeof(uint32_t)
+#define HEADER_SHARD_COUNT_OFFSET (HEADER_GENERATION_OFFSET + HEADER_GENERATION_SIZE)
+#define HEADER_SHARD_INDEX_SIZE sizeof(uint32_t)
+#define HEADER_SHARD_INDEX_OFFSET (HEADER_SHARD_COUNT_OFFSET + HEADER_SHARD_COUNT_SIZE)
+/* first page of the email domain dictionary, 0 while it is empty */
+#define HEADER_DICTIONARY_PAGE_SIZE sizeof(uint64_t)
+#define HEADER_DICTIONARY_PAGE_OFFSET (HEADER_SHARD_INDEX_OFFSET + HEADER_SHARD_INDEX_SIZE)
 
 // Node header sizes
 #define NODE_TYPE_SIZE 1
 #define IS_ROOT_SIZE 1
-#define PARENT_POINTER_SIZE 4
 #define NODE_TYPE_OFFSET 0
 
+/* Nodes do not store a parent pointer: inserts remember the root-to-leaf path
+   in the cursor and splits walk back up that path instead. */
 #define IS_ROOT_OFFSET NODE_TYPE_SIZE
-#define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE)
-#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
+#define NODE_RESERVED_SIZE 6 /* keeps the 64-bit fields below 8-byte aligned */
+/* file generation current when the page was last written */
+#define NODE_GENERATION_SIZE sizeof(uint64_t)
+#define NODE_GENERATION_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE + NODE_RESERVED_SIZE)
+#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_RESERVED_SIZE + NODE_GENERATION_SIZE)
 
 // Leaf node header
 #define LEAF_NODE_NUM_CELLS_SIZE 4
 #define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_HEADER_SIZE
-#define LEAF_NODE_NEXT_LEAF_SIZE (sizeof(uint32_t))
-#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
-#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_LAYOUT_SIZE 1
+#define LEAF_NODE_LAYOUT_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_RESERVED_SIZE 1
+/* cells the leaf has room for, which follows from the page size */
+#define LEAF_NODE_MAX_CELLS_SIZE sizeof(uint16_t)
+#define LEAF_NODE_MAX_CELLS_OFFSET (LEAF_NODE_LAYOUT_OFFSET + LEAF_NODE_LAYOUT_SIZE + LEAF_NODE_RESERVED_SIZE)
+#define LEAF_NODE_NEXT_LEAF_SIZE (sizeof(uint64_t))
+#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_MAX_CELLS_OFFSET + LEAF_NODE_MAX_CELLS_SIZE)
+#define LEAF_NODE_HEADER_SIZE (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
 
 // Leaf node body
-#define LEAF_NODE_KEY_SIZE 4
+#define LEAF_NODE_KEY_SIZE 8
 #define LEAF_NODE_KEY_OFFSET 0
 #define LEAF_NODE_VALUE_SIZE ROW_SIZE
 #define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
+/* rounded up so every cell's key stays 8-byte aligned */
+#define LEAF_NODE_CELL_SIZE ((LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE + 7) & ~(size_t)7)
+#define LEAF_NODE_MAX_CELLS(page_size) (((page_size) - LEAF_NODE_HEADER_SIZE) / LEAF_NODE_CELL_SIZE)
+/* Dictionary leaf cells: the email's domain is replaced by a code into the
+   table's domain dictionary, and only the local part stays in the cell */
+#define EMAIL_LOCAL_SIZE 64 /* longest local part, as in RFC 5321 */
+#define LEAF_DICT_CODE_SIZE sizeof(uint16_t)
+#define LEAF_DICT_CODE_OFFSET LEAF_NODE_KEY_SIZE
+#define LEAF_DICT_USERNAME_OFFSET (LEAF_DICT_CODE_OFFSET + LEAF_DICT_CODE_SIZE)
+#define LEAF_DICT_LOCAL_SIZE (EMAIL_LOCAL_SIZE + 1)
+#define LEAF_DICT_LOCAL_OFFSET (LEAF_DICT_USERNAME_OFFSET + USERNAME_SIZE)
+#define LEAF_DICT_CELL_SIZE ((LEAF_DICT_LOCAL_OFFSET + LEAF_DICT_LOCAL_SIZE + 7) & ~(size_t)7)
+#define LEAF_DICT_MAX_CELLS(page_size) (((page_size) - LEAF_NODE_HEADER_SIZE) / LEAF_DICT_CELL_SIZE)
+
+/* the most any leaf can hold, for arrays sized per leaf; dictionary leaves
+   have the smallest cells, so the most of them */
+#define LEAF_NODE_MAX_CELLS_LIMIT LEAF_DICT_MAX_CELLS(PAGE_SIZE_MAX)
+
+/* Domain dictionary pages: a chain of length-prefixed domains in code order,
+   after the common header so they get a generation stamp like the nodes */
+#define EMAIL_DOMAINS_MAX 65535 /* code 0 keeps the whole email in the cell */
+#define EMAIL_DOMAIN_CHUNK 256  /* domains are found by code in chunks of this many */
+#define DICTIONARY_NEXT_PAGE_OFFSET COMMON_NODE_HEADER_SIZE
+#define DICTIONARY_USED_OFFSET (DICTIONARY_NEXT_PAGE_OFFSET + sizeof(uint64_t)) /* bytes of domains on the page */
+#define DICTIONARY_HEADER_SIZE (DICTIONARY_USED_OFFSET + sizeof(uint32_t))
+
+/* PAX leaves keep the same number of cells, stored as one minipage per column:
+   all keys (which double as ids), then all usernames, then all emails. */
+#define LEAF_PAX_KEYS_OFFSET LEAF_NODE_HEADER_SIZE
+#define LEAF_PAX_USERNAMES_OFFSET(max_cells) (LEAF_PAX_KEYS_OFFSET + (max_cells) * LEAF_NODE_KEY_SIZE)
+#define LEAF_PAX_EMAILS_OFFSET(max_cells) (LEAF_PAX_USERNAMES_OFFSET(max_cells) + (max_cells) * USERNAME_SIZE)
 
 // Internal node layout and config
 #define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_HEADER_SIZE
-#define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
-#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_RESERVED_SIZE 4
+#define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint64_t)
+#define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RESERVED_SIZE)
+#define INTERNAL_NODE_HEADER_SIZE (INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+#define INTERNAL_NODE_KEY_SIZE sizeof(uint64_t)
+#define INTERNAL_NODE_CHILD_SIZE sizeof(uint64_t)
 #define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
 
 /* Keep internal node capacity small for easier testing (patch uses small number) */
 #define INTERNAL_NODE_MAX_CELLS 3
 
 /* invalid page number marker for empty child slots */
-#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_PAGE_NUM UINT64_MAX
+
+/* deepest root-to-leaf path a cursor can remember */
+#define TABLE_MAX_DEPTH 64
 
 typedef struct
 {
@@ -106,11 +227,44 @@ typedef enum
     STATEMENT_SELECT
 } statementtype;
 
+/* projection bits for select */
+#define COLUMN_ID (1 << 0)
+#define COLUMN_USERNAME (1 << 1)
+#define COLUMN_EMAIL (1 << 2)
+#define COLUMN_ALL (COLUMN_ID | COLUMN_USERNAME | COLUMN_EMAIL)
+
+typedef enum
+{
+    STRING_MATCH_ANY,
+    STRING_MATCH_EQUAL,
+    STRING_MATCH_PREFIX,
+    STRING_MATCH_SUFFIX
+} stringmatchtype;
+
+typedef struct
+{
+    stringmatchtype type;
+    size_t length;
+    char value[COLUMN_EMAIL_SIZE + 1];
+} stringpredicate;
+
+/* WHERE clause of a select, evaluated directly against the leaf bytes */
+typedef struct
+{
+    uint64_t id_min;
+    uint64_t id_max;
+    stringpredicate username;
+    stringpredicate email;
+    uint8_t columns;
+    bool descending; /* order by id desc: scan from id_max down */
+} scanpredicate;
+
 typedef enum
 {
     EXECUTE_SUCCESS,
     EXECUTE_TABLE_FULL,
-    EXECUTE_DUPLICATE_KEY
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_EMAIL_NOT_STORABLE /* too long for a dictionary leaf */
 } executeresult;
 
 typedef enum
@@ -119,51 +273,621 @@ typedef enum
     NODE_LEAF
 } nodetype;
 
+/* how a leaf stores its cells; every leaf of a table inherits the root's */
+typedef enum
+{
+    LEAF_LAYOUT_ROW, /* key and row side by side in each cell */
+    LEAF_LAYOUT_PAX, /* one minipage per column */
+    LEAF_LAYOUT_DICT /* row cells with the email domain as a dictionary code */
+} leaflayout;
+
+/* --- Statement programs ---
+   A statement is compiled into a short program for a small virtual machine
+   that opens a cursor, seeks it, steps it, reads columns, compares and emits
+   rows. The values in the statement are not part of the program. They are
+   numbered parameters and are bound separately for each run. */
+typedef enum
+{
+    OP_HALT,
+    OP_RANGE,   /* narrow the id range by comparison p1 with parameter p2 */
+    OP_FILTER,  /* push parameter p2 down into the scan as the predicate on column p1 */
+    OP_OPEN,    /* prepare a cursor reading columns p1, from the top of the range if p2 */
+    OP_SEEK,    /* position the cursor at the start of the range; jump to p3 if it is empty */
+    OP_NEXT,    /* step the cursor into the row; jump to p3 past the last row */
+    OP_COLUMN,  /* load column p1 of the row */
+    OP_COMPARE, /* jump to p3 unless the loaded column matches parameter p2 */
+    OP_LIMIT,   /* jump to p3 once parameter p2 rows have been emitted */
+    OP_EMIT,    /* return columns p1 of the row */
+    OP_GOTO,    /* jump to p3 */
+    OP_CLOSE,
+    OP_INSERT /* insert p3 rows from the parameters starting at p2, as a batch if p1 */
+} opcode;
+
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t p1;
+    uint32_t p2;
+    uint32_t p3;
+} instruction;
+
+/* id comparisons, in the order of id_comparison_keywords */
+typedef enum
+{
+    ID_EQUAL,
+    ID_AT_LEAST,
+    ID_GREATER,
+    ID_AT_MOST,
+    ID_LESS
+} idcomparison;
+
+typedef enum
+{
+    PARAM_ID,
+    PARAM_LIMIT,
+    PARAM_USERNAME,
+    PARAM_EMAIL
+} paramkind;
+
+/* where a parameter comes from in the statement */
+typedef struct
+{
+    uint32_t token;
+    uint8_t kind;  /* paramkind */
+    uint8_t match; /* stringmatchtype of a string compared with a column */
+} programparam;
+
+/* a parameter bound to one statement */
+typedef struct
+{
+    uint64_t integer;  /* PARAM_ID and PARAM_LIMIT */
+    const char *text;  /* strings, in the input buffer and without the % of a pattern */
+    size_t length;
+    stringmatchtype match;
+} programvalue;
+
+typedef struct
+{
+    char *shape; /* the statement's keywords, with ? for each parameter */
+    uint32_t hash;
+    statementtype type;
+    instruction *code;
+    uint32_t num_instructions;
+    programparam *params;
+    uint32_t num_params;
+    stringpredicate *compares; /* by parameter, bound once per run for OP_COMPARE */
+    uint64_t uses;
+    uint64_t last_used; /* cache clock, to evict the least recently used */
+} program;
+
+typedef struct
+{
+    const char *text; /* in the input buffer, not NUL-terminated */
+    uint32_t length;
+    bool keyword;          /* a keyword or punctuation: part of the shape */
+    stringmatchtype match; /* of a parameter, by where its % is: part of the shape too */
+} sqltoken;
+
+/* compiled programs by shape, so a repeated statement is not compiled again */
+#define PROGRAM_CACHE_SIZE 64
+
+typedef struct
+{
+    program *programs[PROGRAM_CACHE_SIZE];
+    uint32_t count;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t compiles;
+    /* reused by each statement in turn, so one seen before allocates nothing */
+    sqltoken *tokens;
+    uint32_t token_capacity;
+    programvalue *values;
+    uint32_t value_capacity;
+} programcache;
+
 typedef struct
 {
     statementtype type;
     row row_to_insert;
+    row *rows_to_insert; /* insert values (...), (...): malloc'd, NULL for one row */
+    uint32_t num_rows_to_insert;
+    program *program;     /* NULL for statements the server builds itself */
+    programvalue *values; /* one per program parameter, owned by the program cache */
+    bool explain;         /* explain analyze: run it and report what it did instead */
+    bool list_program;    /* explain: print the program instead of running it */
 } statement;
 
+/* What one statement did to one tree, collected while explain analyze runs
+   it. Only the last root-to-leaf descent is kept. */
+typedef struct
+{
+    uint64_t descents;
+    uint32_t depth; /* internal nodes on the last descent */
+    uint64_t path[TABLE_MAX_DEPTH];
+    uint32_t path_child[TABLE_MAX_DEPTH];
+    uint64_t leaf_page_num;
+    uint32_t leaf_cell;
+    uint64_t cache_hits;
+    uint64_t readahead_waits; /* hits on pages still being prefetched */
+    uint64_t disk_reads;
+    uint64_t new_pages; /* past the end of the file, so zeroed rather than read */
+    uint64_t shared_hits; /* copied from the shared cache instead of read */
+    uint64_t pages_prefetched;
+    uint64_t leaves_walked;
+    uint64_t rows_examined;
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t new_roots;
+    double descend_seconds;
+    double split_seconds;
+} statementtrace;
+
+/* --- Readahead --- */
+#define READAHEAD_MAX_WINDOW 32
+#define READAHEAD_THREADS 4
+
+/* frame state values: a cached page is either usable or still being read
+   by readahead, or busy while a thread reads it in or writes it back
+   without holding pager->lock */
+#define PAGE_READY 0
+#define PAGE_LOADING 1
+#define PAGE_FAILED 2
+#define PAGE_BUSY 3
+
+typedef struct
+{
+    uint64_t page_num;
+    uint32_t frame_index;
+    void *buffer;
+} readaheadrequest;
+
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+typedef struct
+{
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct iovec iovecs[PAGER_CACHE_PAGES];
+} iouring;
+#endif
+
+/* Reads the next leaves of a scan in the background, through io_uring when the
+   kernel allows it and through a small pread thread pool otherwise. */
+typedef struct
+{
+    int file_descriptor;
+    bool use_io_uring;
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+    iouring ring;
+#endif
+    uint32_t in_flight;
+    bool shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t page_ready;
+    readaheadrequest queue[READAHEAD_MAX_WINDOW];
+    uint32_t queue_head;
+    uint32_t queue_length;
+    pthread_t threads[READAHEAD_THREADS];
+    uint32_t num_threads;
+} readaheadpool;
+
+/* Online backup of the file as it was when .backup ran. Statements keep
+   changing pages meanwhile, so a page that has not been copied yet is saved
+   before its first change and the saved image is copied instead. */
+typedef struct
+{
+    int file_descriptor; /* the backup file */
+    int source_descriptor;
+    char path[256];
+    uint32_t page_size;
+    uint64_t snapshot_pages;
+    uint64_t snapshot_generation;
+    /* incremental: pages last written at or before this generation are
+       already in the target */
+    uint64_t base_generation;
+    bool incremental;
+    pthread_mutex_t lock;
+    uint8_t *copied; /* one bit per snapshot page */
+    void **saved;    /* pre-images of pages changed before they were copied */
+    atomic_uint_fast64_t pages_scanned;
+    atomic_uint_fast64_t pages_copied;
+    atomic_bool finished;
+    bool failed;
+    pthread_t thread;
+} backup;
+
+/* Writes the oldest dirty pages back at a steady rate, so evictions and
+   commits find little left to write. An insert waits only while the dirty
+   pages are above the high-water mark, and only until the writer has
+   brought them back under it. */
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     /* an insert is waiting, or shutdown */
+    pthread_cond_t progress; /* a batch was written */
+    bool shutdown;
+    bool stuck;          /* the last batch found nothing it was allowed to write */
+    uint32_t rate;       /* pages per second while under the high-water mark */
+    uint32_t high_water; /* in pages */
+    uint32_t in_flight;  /* pages pinned by the batch being written; under pager->lock */
+    char *staging;       /* copies of the batch being written, PAGEWRITER_BATCH pages */
+    bool staging_mapped;
+    uint64_t pages_written;
+    uint64_t throttled;
+    double throttled_seconds;
+    double longest_throttle;
+} pagewriter;
+
+/* One page of the shared cache. Free slots have no page number. */
+typedef struct
+{
+    uint64_t page_num;
+    int32_t hash_next;
+    bool dirty; /* newer than the file */
+    bool referenced;
+} sharedslot;
+
+/* The start of the -shm file, mapped by every process that has it open;
+   the slots' pages follow at the next multiple of the page size. */
+typedef struct
+{
+    char magic[SHARED_MAGIC_SIZE];
+    uint32_t page_size;
+    pthread_mutex_t lock; /* process-shared and robust; guards all of the below */
+    int32_t busy_slot;    /* being filled, -1 for none; dropped if its filler dies */
+    uint32_t clock_hand;
+    uint64_t num_pages;
+    /* every page a writer changed, the n-th at changes[n % SHARED_CHANGE_LOG] */
+    uint64_t sequence;
+    uint64_t changes[SHARED_CHANGE_LOG];
+    uint64_t recoveries; /* times a dead owner of the lock was cleaned up after */
+    int32_t buckets[SHARED_HASH_BUCKETS];
+    sharedslot slots[SHARED_CACHE_PAGES];
+} sharedheader;
+
+/* This process's view of the shared cache. */
+typedef struct
+{
+    int file_descriptor; /* the -shm file, which the byte-range locks are on */
+    sharedheader *header;
+    char *pages;
+    size_t size;
+    uint64_t seen;     /* header->sequence this process has caught up with */
+    bool writing;      /* holds the statement lock exclusively */
+    uint64_t *touched; /* pages dirtied by the running write statement */
+    uint32_t num_touched, touched_capacity;
+    uint64_t hits, misses, published, forgotten;
+} sharedcache;
+
+typedef enum
+{
+    SHARED_UNCHANGED,
+    SHARED_CHANGED,
+    SHARED_CHANGED_WATCHED /* among the changes is the page the caller watches */
+} sharedchanges;
+
+/* One cached page. Frames are found through a hash of the page number. */
+typedef struct
+{
+    uint64_t page_num;
+    void *data;
+    bool dirty;
+    uint64_t dirtied_at; /* pager dirty_sequence when it last became dirty */
+    bool referenced;    /* clock bit for eviction */
+    uint64_t last_used; /* pager epoch of the last get_page */
+    int32_t hash_next;  /* next frame in the same bucket, -1 ends the chain */
+    atomic_uchar state;
+    /* concurrent writers latch pages instead; a latched page stays pinned */
+    atomic_uint pin_count;
+    pthread_rwlock_t latch;
+} frame;
+
 typedef struct
 {
+    pthread_mutex_t lock; /* the frame table, page count and epoch */
     int file_descriptor;
-    uint32_t file_length;
-    uint32_t num_pages;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t page_size;
+    uint64_t file_length;
+    uint64_t num_pages;
+    frame frames[PAGER_CACHE_PAGES];
+    uint32_t frames_used;
+    char *slab; /* PAGER_CACHE_PAGES * page_size bytes that back the frames */
+    bool slab_mapped;
+    int32_t buckets[PAGER_HASH_BUCKETS];
+    uint32_t clock_hand;
+    /* pages returned by get_page since the last pager_unpin_all are never evicted */
+    uint64_t epoch;
+    readaheadpool *readahead; /* started by the first scan that wants it */
+    backup *backup;           /* set while .backup runs and until the next one */
+    uint64_t generation;      /* stamped into every page written */
+    bool direct_io;
+    uint64_t pages_read;
+    uint64_t pages_written;
+    uint64_t write_calls;
+    statementtrace *trace; /* set while explain analyze runs a statement */
+    atomic_uint dirty_pages;
+    uint64_t dirty_sequence;
+    pagewriter *writer; /* set when the database runs a background writer */
+    /* held by whoever writes dirty pages back without holding lock, except
+       an eviction, which keeps its one frame busy instead */
+    pthread_mutex_t write_lock;
+    pthread_cond_t frame_ready; /* with lock, signalled when a busy frame is ready */
+    uint32_t busy_frames;
+    sharedcache *shared; /* set when the file is opened with --shared */
 } pager;
 
+/* how the database file is opened; set from the command line */
+typedef struct
+{
+    bool direct_io; /* bypass the kernel page cache with O_DIRECT */
+    leaflayout leaf_layout; /* used when the file is created */
+    uint32_t num_shards;    /* used when the file is created, 0 for one tree */
+    uint32_t page_size;     /* used when the file is created, 0 for the default */
+    uint32_t writer_rate;   /* background writer pages per second, 0 for none */
+    uint32_t dirty_high_water; /* percent of the cache, 0 for the default */
+    uint32_t row_cache_rows;   /* rows kept by the row cache, 0 for none */
+    bool shared;               /* other processes may have the file open too */
+} dboptions;
+
+typedef struct
+{
+    uint64_t id;
+    row row;
+    bool present;         /* false remembers that the id is not in the table */
+    int32_t hash_next;    /* next entry in the same bucket or on the free list */
+    int32_t newer, older; /* recency list, -1 at either end */
+} rowcacheentry;
+
+/* Decoded rows of point lookups keyed by id, in a fixed number of entries.
+   When it is full a new id replaces the least recently used entry only if
+   the sketch has seen it more often (TinyLFU), so a sweep of one-off ids
+   cannot push the hot rows out. */
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t used; /* entries handed out so far, free or not */
+    rowcacheentry *entries;
+    int32_t *buckets;
+    uint32_t bucket_mask;
+    int32_t free_list; /* invalidated entries, chained through hash_next */
+    uint32_t num_free;
+    int32_t newest, oldest;
+    uint8_t *sketch; /* ROWCACHE_SKETCH_DEPTH rows of sketch_mask + 1 counters */
+    uint32_t sketch_mask;
+    uint32_t sketch_count; /* lookups since the counters were last halved */
+    uint64_t hits, misses, admitted, rejected, invalidated;
+} rowcache;
+
+/* Every email domain stored in a dictionary leaf of one tree, numbered from 1
+   in the order they were first inserted. All of it is kept in memory, and each
+   new domain is appended to the dictionary pages at once. */
+typedef struct
+{
+    pthread_mutex_t lock; /* finding or adding a domain; decoding takes no lock */
+    atomic_uint count;
+    char **chunks[(EMAIL_DOMAINS_MAX + EMAIL_DOMAIN_CHUNK) / EMAIL_DOMAIN_CHUNK];
+    uint16_t *slots; /* codes by hash of the domain, 0 for an empty slot */
+    uint32_t slot_mask;
+    pager *pager;           /* where new domains are stored */
+    uint64_t last_page_num; /* 0 until the first domain is stored */
+} emaildictionary;
+
+/* .vacuum copies the tree in key order into packed, consecutive pages of a
+   new file a slice at a time, then renames it over the database. */
+typedef enum
+{
+    VACUUM_COPY_LEAVES,
+    VACUUM_BUILD_INTERNAL
+} vacuumphase;
+
+typedef struct
+{
+    char path[PATH_MAX];
+    pager *pager; /* the new file */
+    vacuumphase phase;
+    uint64_t next_key; /* every row below this has been copied */
+    bool copied_all;
+    uint64_t leaf_page_num; /* leaf being filled, 0 before the first */
+    uint64_t rows_copied;
+    uint64_t old_pages;
+    /* max key and page of each node of the level built last, and of the
+       level being built above it */
+    uint64_t *max_keys, *page_nums;
+    uint64_t num_nodes, nodes_grouped;
+    uint64_t *parent_max_keys, *parent_page_nums;
+    uint64_t num_parents;
+    /* rows inserted below next_key while the copy runs */
+    row *late_rows;
+    uint32_t num_late_rows, late_rows_capacity;
+} vacuum;
+
+typedef struct shard shard;
+
+/* A sharded table has no pager or tree of its own: it routes every id by
+   hash to one of its shards, each a complete table in its own file. */
 typedef struct
 {
-    uint32_t root_page_num;
+    uint64_t root_page_num;
     pager *pager;
+    char *filename;
+    dboptions options;
+    vacuum *vacuum; /* set while .vacuum runs */
+    uint32_t num_shards;
+    shard *shards;
+    rowcache *row_cache; /* of this tree; a sharded table has one per shard */
+    emaildictionary *dictionary; /* set when the tree has dictionary leaves */
 } table;
 
+typedef enum
+{
+    SHARD_JOB_NONE,
+    SHARD_JOB_CHECK, /* look for duplicates, write nothing */
+    SHARD_JOB_INSERT,
+    SHARD_JOB_SYNC, /* flush and fdatasync */
+    SHARD_JOB_STOP
+} shardjob;
+
+/* One shard and the writer thread that owns it while a job runs. */
+struct shard
+{
+    table *table;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    shardjob job;
+    row *rows; /* the shard's part of a batch, sorted */
+    uint32_t num_rows;
+    executeresult result;
+};
+
 typedef struct
 {
     table *table;
-    uint32_t page_num;
+    uint64_t page_num;
     uint32_t cell_num;
     bool end_of_table;
+    uint32_t readahead_window; /* 0 for point lookups */
+    bool backward;             /* reads ahead to the left */
+    /* internal nodes above the leaf and the child taken in each of them */
+    uint32_t depth;
+    uint64_t path[TABLE_MAX_DEPTH];
+    uint32_t path_child[TABLE_MAX_DEPTH];
 } cursor;
 
+/* A row view points into a cached leaf page instead of copying the row out.
+   It is only valid until the cursor moves on to another page. */
+typedef struct
+{
+    uint64_t id;
+    const char *username;
+    const char *email;
+    const char *email_domain; /* dictionary leaves: goes after email and an '@' */
+} rowview;
+
+typedef struct
+{
+    cursor cursor;
+    scanpredicate *predicate;
+    /* string predicates are evaluated a leaf at a time, column by column */
+    uint64_t filtered_page_num;
+    void *node; /* the cached page of filtered_page_num */
+    statementtrace *trace;
+    /* an email predicate that names a whole domain is compared by its code
+       on dictionary leaves; 0 when the dictionary has no such domain */
+    bool email_by_code;
+    uint16_t email_domain_code;
+    size_t email_local_length; /* of an email = predicate, before the '@' */
+    bool matches[LEAF_NODE_MAX_CELLS_LIMIT];
+} scanoperator;
+
+/* One scan per shard, merged by id; a single scan for an unsharded table. */
+typedef struct
+{
+    uint32_t num_scans;
+    scanoperator *scans;
+    row *heads; /* next row of each scan, NULL when there is only one */
+    bool *live;
+} mergescan;
+
 /* --- Prototypes (including new internal split/insert API) --- */
 void print_row(row *row);
 void serialize_row(row *source, void *destination);
 void deserialize_row(void *source, row *destination);
-
-pager *pager_open(const char *filename);
-void *get_page(pager *pager, uint32_t page_num);
-uint32_t get_unused_page_num(pager *pager);
-
-cursor *table_start(table *table);
-cursor *table_find(table *table, uint32_t key);
-cursor *leaf_node_find(table *table, uint32_t page_num, uint32_t key);
+void materialize_row(rowview *view, uint8_t columns, row *destination);
+void print_projected_row(row *row, uint8_t columns);
+
+pager *pager_open(const char *filename, const dboptions *options);
+void *get_page(pager *pager, uint64_t page_num);
+void pager_unpin_all(pager *pager);
+frame *pager_latch(pager *pager, uint64_t page_num, bool exclusive);
+void pager_unlatch(frame *frame);
+void readahead_pages(pager *pager, uint64_t *page_nums, uint32_t count);
+void readahead_wait(pager *pager, uint32_t frame_index);
+void readahead_close(pager *pager);
+uint64_t get_unused_page_num(pager *pager);
+void pager_mark_dirty(pager *pager, uint64_t page_num);
+void pager_flush(pager *pager);
+void pager_drop_dirty(pager *pager);
+void pagewriter_start(pager *pager, const dboptions *options);
+void pagewriter_stop(pager *pager);
+void pager_throttle(pager *pager);
+
+sharedcache *shared_open(pager *pager, const char *filename);
+void shared_close(pager *pager);
+bool shared_read_page(pager *pager, uint64_t page_num, void *destination);
+void shared_offer_page(pager *pager, uint64_t page_num, const void *page);
+void shared_drop_pages(pager *pager, uint64_t first_page_num, uint32_t count);
+void shared_touch(sharedcache *shared, uint64_t page_num);
+void shared_write_back(pager *pager);
+sharedchanges pager_shared_begin(pager *pager, bool write, uint64_t watch_page_num);
+void pager_shared_end(pager *pager);
+
+bool backup_start(table *table, const char *path, bool incremental);
+void backup_save_page(backup *backup, uint64_t page_num, const void *page);
+void backup_finish(pager *pager);
+
+void table_start(table *table, cursor *cursor);
+void table_find(table *table, uint64_t key, cursor *cursor);
+void leaf_node_find(table *table, uint64_t page_num, uint64_t key, cursor *cursor);
 void *cursor_value(cursor *c);
 void cursor_advance(cursor *cursor);
-
-table *db_open(const char *filename);
+void cursor_retreat(cursor *cursor);
+void cursor_readahead(cursor *cursor);
+uint64_t path_next_leaf(pager *pager, uint64_t *path, uint32_t *path_child, uint32_t depth);
+uint64_t path_prev_leaf(pager *pager, uint64_t *path, uint32_t *path_child, uint32_t depth);
+
+void scan_open(scanoperator *scan, table *table, scanpredicate *predicate);
+bool scan_next(scanoperator *scan, row *destination);
+void scan_close(scanoperator *scan);
+void merge_scan_open(mergescan *scan, table *table, scanpredicate *predicate);
+bool merge_scan_next(mergescan *scan, row *destination);
+void merge_scan_close(mergescan *scan);
+
+table *table_open(const char *filename, const dboptions *options, uint32_t shard_index, uint32_t *num_shards);
+table *db_open(const char *filename, const dboptions *options);
+void pager_close(pager *pager);
 void db_close(table *table);
+void db_sync(table *table);
+void table_shared_begin(table *table, bool write);
+void table_shared_end(table *table);
+
+uint32_t shard_for_key(table *table, uint64_t key);
+executeresult sharded_insert_rows(table *table, row *rows, uint32_t count);
+
+emaildictionary *email_dictionary_open(pager *pager, uint64_t first_page_num);
+void email_dictionary_close(emaildictionary *dictionary);
+const char *email_dictionary_domain(emaildictionary *dictionary, uint16_t code);
+uint16_t email_dictionary_find(emaildictionary *dictionary, const char *domain, size_t length);
+bool email_encode(emaildictionary *dictionary, const char *email, bool add, uint16_t *code, size_t *inline_length);
+bool table_rows_storable(table *table, row *rows, uint32_t count);
+bool table_encode_rows(table *table, row *rows, uint32_t count);
+void email_dictionary_rewrite(emaildictionary *dictionary, pager *pager);
+
+rowcache *rowcache_open(uint32_t capacity);
+void rowcache_close(rowcache *cache);
+void rowcache_clear(rowcache *cache);
+bool table_lookup(table *table, uint64_t id, row *destination);
+void table_forget_rows(table *table, row *rows, uint32_t count);
+
+bool vacuum_start(table *table);
+bool vacuum_step(table *table);
+void vacuum_note_rows(table *table, row *rows, uint32_t count);
+void vacuum_abandon(table *table);
+void print_fragmentation(table *table);
 
 void print_prompt();
 void read_input(inputbuffer *input_buffer);
@@ -171,55 +895,81 @@ inputbuffer *new_input_buffer();
 void close_input_buffer(inputbuffer *input_buffer);
 
 metacommandresult do_meta_command(inputbuffer *input_buffer, table *table);
-prepareresult prepare_insert(inputbuffer *input_buffer, statement *statement);
-prepareresult prepare_statement(inputbuffer *input_buffer, statement *statement);
-executeresult execute_select(statement *statement, table *table);
+programcache *program_cache_open();
+void print_program(programcache *cache, program *program);
+prepareresult prepare_statement(inputbuffer *input_buffer, statement *statement, programcache *programs);
+executeresult program_run(statement *statement, table *table, uint64_t *rows);
 executeresult execute_insert(statement *statement, table *table);
 executeresult execute_statement(statement *statement, table *table);
+double clock_seconds();
+void trace_descent(statementtrace *trace, cursor *cursor, double started);
+executeresult explain_statement(statement *statement, table *table, double parse_seconds);
+
+/* --- File header helpers --- */
+uint32_t *header_version(void *page);
+uint32_t *header_page_size(void *page);
+uint64_t *header_root_page_num(void *page);
+uint64_t *header_generation(void *page);
+uint32_t *header_shard_count(void *page);
+uint32_t *header_shard_index(void *page);
+uint64_t *header_dictionary_page_num(void *page);
+bool page_size_valid(uint32_t page_size);
+void initialize_file_header(void *page, uint32_t page_size);
 
 /* --- Node helpers --- */
+uint64_t *node_generation(void *node);
 uint32_t *leaf_node_num_cells(void *node);
-uint32_t *leaf_node_next_leaf(void *node);
+uint64_t *leaf_node_next_leaf(void *node);
 void *leaf_node_cell(void *node, uint32_t cell_num);
-uint32_t *leaf_node_key(void *node, uint32_t cell_num);
+uint64_t *leaf_node_key(void *node, uint32_t cell_num);
 void *leaf_node_value(void *node, uint32_t cell_num);
-void initialize_leaf_node(void *node);
+leaflayout leaf_node_layout(void *node);
+char *leaf_node_username(void *node, uint32_t cell_num);
+char *leaf_node_email(void *node, uint32_t cell_num);
+uint16_t *leaf_node_email_code(void *node, uint32_t cell_num);
+void leaf_node_write_row(emaildictionary *dictionary, void *node, uint32_t cell_num, row *source);
+void leaf_node_copy_cell(void *destination_node, uint32_t destination_cell, void *source_node, uint32_t source_cell);
+void leaf_node_row_view(emaildictionary *dictionary, void *node, uint32_t cell_num, rowview *view);
+uint32_t leaf_node_max_cells(void *node);
+void initialize_leaf_node(void *node, leaflayout layout, uint32_t page_size);
 
 uint32_t *internal_node_num_keys(void *node);
-uint32_t *internal_node_right_child(void *node);
-uint32_t *internal_node_cell(void *node, uint32_t cell_num);
-uint32_t *internal_node_child(void *node, uint32_t child_num);
-uint32_t *internal_node_key(void *node, uint32_t key_num);
+uint64_t *internal_node_right_child(void *node);
+uint64_t *internal_node_cell(void *node, uint32_t cell_num);
+uint64_t *internal_node_child(void *node, uint32_t child_num);
+uint64_t *internal_node_key(void *node, uint32_t key_num);
 void initialize_internal_node(void *node);
 
-uint32_t *node_parent(void *node);
-
 /* node type / root flag */
 nodetype get_node_type(void *node);
 void set_node_type(void *node, nodetype type);
 bool is_node_root(void *node);
 void set_node_root(void *node, bool is_root);
-void create_new_root(table *table, uint32_t right_child_page_num);
+void create_new_root(table *table, uint64_t left_max, uint64_t right_child_page_num);
 
 /* leaf insert/split */
-void leaf_node_insert(cursor *cursor, uint32_t key, row *value);
-void leaf_node_split_and_insert(cursor *cursor, uint32_t key, row *value);
+void leaf_node_insert(cursor *cursor, uint64_t key, row *value);
+void leaf_node_split_and_insert(cursor *cursor, uint64_t key, row *value);
+void leaf_node_merge_rows(cursor *cursor, row *rows, uint32_t count);
+executeresult table_insert_rows(table *table, row *rows, uint32_t count);
+executeresult table_insert_row(table *table, row *value);
+bool table_has_any_key(table *table, row *rows, uint32_t count);
+int compare_rows_by_id(const void *a, const void *b);
 
 /* internal insert/split */
-uint32_t internal_node_find_child(void *node, uint32_t key);
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);
-void internal_node_insert(table *table, uint32_t parent_page_num, uint32_t child_page_num);
-void internal_node_split_and_insert(table *table, uint32_t parent_page_num, uint32_t child_page_num);
+uint32_t internal_node_find_child(void *node, uint64_t key);
+void internal_node_insert(cursor *cursor, uint32_t level, uint64_t left_max, uint64_t new_child_page_num);
+void internal_node_split_and_insert(cursor *cursor, uint32_t level, uint64_t left_max, uint64_t new_child_page_num);
 
 /* debugging / btree print */
-void print_tree(pager *pager, uint32_t page_num, uint32_t indentation_level);
+void print_tree(pager *pager, uint64_t page_num, uint32_t indentation_level);
 void indent(uint32_t level);
 void print_constants();
 
 /* --- Row functions --- */
 void print_row(row *row)
 {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    printf("(%" PRIu64 ", %s, %s)\n", row->id, row->username, row->email);
 }
 
 void serialize_row(row *source, void *destination)
@@ -236,894 +986,6349 @@ void deserialize_row(void *source, row *destination)
     memcpy(&(destination->email), (char *)source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-/* --- Pager --- */
-pager *pager_open(const char *filename)
+/* --- Row views --- */
+
+/* copy only the projected columns out of the page */
+void materialize_row(rowview *view, uint8_t columns, row *destination)
 {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-    if (fd == -1)
+    destination->id = view->id;
+    if (columns & COLUMN_USERNAME)
+        memcpy(destination->username, view->username, USERNAME_SIZE);
+    if (columns & COLUMN_EMAIL)
     {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+        /* a dictionary leaf's inline email is shorter than EMAIL_SIZE */
+        if (view->email_domain != NULL)
+            snprintf(destination->email, EMAIL_SIZE, "%s@%s", view->email, view->email_domain);
+        else
+        {
+            size_t length = strnlen(view->email, EMAIL_SIZE - 1);
+            memcpy(destination->email, view->email, length);
+            destination->email[length] = '\0';
+        }
     }
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
-
-    pager *pager = malloc(sizeof(pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length + PAGE_SIZE - 1) / PAGE_SIZE; // allow empty/new DB
-
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+void print_projected_row(row *row, uint8_t columns)
+{
+    const char *separator = "";
+    printf("(");
+    if (columns & COLUMN_ID)
     {
-        pager->pages[i] = NULL;
+        printf("%" PRIu64, row->id);
+        separator = ", ";
     }
-
-    return pager;
+    if (columns & COLUMN_USERNAME)
+    {
+        printf("%s%s", separator, row->username);
+        separator = ", ";
+    }
+    if (columns & COLUMN_EMAIL)
+        printf("%s%s", separator, row->email);
+    printf(")\n");
 }
 
-void *get_page(pager *pager, uint32_t page_num)
+/* --- Pager --- */
+/* One page-aligned block for every frame, so a cache miss never allocates.
+   Explicit huge pages are tried first, then transparent huge pages. */
+char *pager_allocate_slab(size_t size, bool *mapped)
 {
-    if (page_num >= TABLE_MAX_PAGES)
+#ifdef __linux__
+    void *slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (slab == MAP_FAILED)
+    {
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (slab != MAP_FAILED)
+            madvise(slab, size, MADV_HUGEPAGE);
+#endif
+    }
+    if (slab != MAP_FAILED)
+    {
+        *mapped = true;
+        return slab;
+    }
+#endif
+    *mapped = false;
+    char *slab_memory = malloc(size);
+    if (slab_memory == NULL)
     {
-        printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
+        printf("Unable to allocate page cache\n");
         exit(EXIT_FAILURE);
     }
+    return slab_memory;
+}
 
-    if (pager->pages[page_num] == NULL)
+void pager_free_slab(char *slab, size_t size, bool mapped)
+{
+#ifdef __linux__
+    if (mapped)
     {
-        void *page = malloc(PAGE_SIZE);
-        memset(page, 0, PAGE_SIZE); // zero the page to avoid garbage
+        munmap(slab, size);
+        return;
+    }
+#endif
+    (void)size;
+    free(slab);
+}
 
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-        if (pager->file_length % PAGE_SIZE)
-            num_pages += 1;
+pager *pager_open(const char *filename, const dboptions *options)
+{
+    pager *pager = malloc(sizeof(*pager));
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (fd == -1)
+    {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+    off_t file_length = lseek(fd, 0, SEEK_END);
 
-        if (page_num < num_pages)
+    /* an existing file has its page size in the header, read before the
+       frames are sized by it */
+    pager->page_size = options->page_size != 0 ? options->page_size : PAGE_SIZE_DEFAULT;
+    if (file_length > 0)
+    {
+        char header[PAGE_SIZE_MIN];
+        if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            !page_size_valid(*header_page_size(header)))
         {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1)
-            {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
+            printf("Unsupported database file format.\n");
+            exit(EXIT_FAILURE);
         }
-        pager->pages[page_num] = page;
-        if (page_num >= pager->num_pages)
-            pager->num_pages = page_num + 1;
+        pager->page_size = *header_page_size(header);
     }
+    pager->slab = pager_allocate_slab((size_t)PAGER_CACHE_PAGES * pager->page_size, &pager->slab_mapped);
+
+    /* O_DIRECT reads and writes straight into the frames, which only the
+       page-aligned mmap'ed slab guarantees */
+    pager->direct_io = false;
+#ifdef O_DIRECT
+    if (options->direct_io && pager->slab_mapped && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0)
+        pager->direct_io = true;
+#endif
+    if (options->direct_io && !pager->direct_io)
+        printf("Direct I/O is not available here, using buffered I/O.\n");
 
-    return pager->pages[page_num];
-}
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length + pager->page_size - 1) / pager->page_size; // allow empty/new DB
+
+    /* a writer waiting to split must not be starved by a stream of readers */
+    pthread_rwlockattr_t latch_attributes;
+    pthread_rwlockattr_init(&latch_attributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&latch_attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_mutex_init(&pager->write_lock, NULL);
+    pthread_cond_init(&pager->frame_ready, NULL);
+    pager->busy_frames = 0;
+    for (uint32_t i = 0; i < PAGER_CACHE_PAGES; i++)
+    {
+        pager->frames[i].data = pager->slab + (size_t)i * pager->page_size;
+        pager->frames[i].dirty = false;
+        pager->frames[i].hash_next = -1;
+        atomic_init(&pager->frames[i].state, PAGE_READY);
+        atomic_init(&pager->frames[i].pin_count, 0);
+        pthread_rwlock_init(&pager->frames[i].latch, &latch_attributes);
+    }
+    pthread_rwlockattr_destroy(&latch_attributes);
+    for (uint32_t i = 0; i < PAGER_HASH_BUCKETS; i++)
+    {
+        pager->buckets[i] = -1;
+    }
+    pager->frames_used = 0;
+    pager->clock_hand = 0;
+    pager->epoch = 1;
+    pager->readahead = NULL;
+    pager->backup = NULL;
+    pager->generation = 0; /* read from the header by db_open */
+    pager->pages_read = 0;
+    pager->pages_written = 0;
+    pager->write_calls = 0;
+    pager->trace = NULL;
+    atomic_init(&pager->dirty_pages, 0);
+    pager->dirty_sequence = 0;
+    pager->writer = NULL;
+    if (options->writer_rate > 0)
+        pagewriter_start(pager, options);
+    pager->shared = options->shared ? shared_open(pager, filename) : NULL;
 
-uint32_t get_unused_page_num(pager *pager) { return pager->num_pages; }
+    return pager;
+}
 
-/* --- Leaf helpers --- */
-uint32_t *leaf_node_num_cells(void *node)
+uint32_t pager_hash(uint64_t page_num)
 {
-    return (uint32_t *)((char *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+    return (uint32_t)((page_num * 0x9E3779B97F4A7C15ull) >> (64 - PAGER_HASH_BITS));
 }
 
-uint32_t *leaf_node_next_leaf(void *node)
+/* frame holding page_num, or -1 if it is not cached */
+int32_t pager_lookup(pager *pager, uint64_t page_num)
 {
-    return (uint32_t *)((char *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+    int32_t index = pager->buckets[pager_hash(page_num)];
+    while (index != -1 && pager->frames[index].page_num != page_num)
+        index = pager->frames[index].hash_next;
+    return index;
 }
 
-void *leaf_node_cell(void *node, uint32_t cell_num)
+/* write count consecutive pages starting at first_page_num in one call */
+void pager_write_pages(pager *pager, uint64_t first_page_num, struct iovec *iovecs, uint32_t count)
 {
-    return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    off_t offset = (off_t)first_page_num * pager->page_size;
+    ssize_t bytes_written = pwritev(pager->file_descriptor, iovecs, count, offset);
+    if (bytes_written != (ssize_t)count * pager->page_size)
+    {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num)
+/* account for pages written to the file; the caller holds pager->lock */
+void pager_count_write(pager *pager, uint64_t first_page_num, uint32_t count)
 {
-    return (uint32_t *)((char *)leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET);
+    uint64_t end = (first_page_num + count) * pager->page_size;
+    if (end > pager->file_length)
+        pager->file_length = end;
+    pager->pages_written += count;
+    pager->write_calls++;
 }
 
-void *leaf_node_value(void *node, uint32_t cell_num)
+/* pager_write_pages, accounted for in the pager; the caller holds pager->lock or is
+   the only thread using the pager */
+void pager_write_run(pager *pager, uint64_t first_page_num, struct iovec *iovecs, uint32_t count)
 {
-    return (char *)leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    /* the file is about to have newer copies than the shared cache */
+    if (pager->shared != NULL)
+        shared_drop_pages(pager, first_page_num, count);
+    pager_write_pages(pager, first_page_num, iovecs, count);
+    pager_count_write(pager, first_page_num, count);
 }
 
-void initialize_leaf_node(void *node)
+/* page 0 is the file header, every other page is a node */
+void pager_stamp_generation(pager *pager, frame *frame)
 {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0;
+    if (frame->page_num != 0)
+        *node_generation(frame->data) = pager->generation;
 }
 
-/* --- Node type and root flag helpers --- */
-nodetype get_node_type(void *node)
+void pager_write_frame(pager *pager, frame *frame)
 {
-    uint8_t value = *((uint8_t *)((char *)node + NODE_TYPE_OFFSET));
-    return (nodetype)value;
+    pager_stamp_generation(pager, frame);
+    struct iovec iovec = {frame->data, pager->page_size};
+    pager_write_run(pager, frame->page_num, &iovec, 1);
+    frame->dirty = false;
+    atomic_fetch_sub_explicit(&pager->dirty_pages, 1, memory_order_relaxed);
 }
 
-void set_node_type(void *node, nodetype type)
+/* Write a dirty victim back with pager->lock, which the caller holds,
+   released for the write. The page stays cached but busy meanwhile, so a
+   thread that wants it waits for the write instead of reading the older
+   copy from the file; it is clean already, so no flush writes it again. */
+void pager_write_back_unlocked(pager *pager, frame *victim)
 {
-    uint8_t value = (uint8_t)type;
-    *((uint8_t *)((char *)node + NODE_TYPE_OFFSET)) = value;
+    uint64_t page_num = victim->page_num;
+    pager_stamp_generation(pager, victim);
+    victim->dirty = false;
+    atomic_fetch_sub_explicit(&pager->dirty_pages, 1, memory_order_relaxed);
+    atomic_store_explicit(&victim->state, PAGE_BUSY, memory_order_relaxed);
+    pager->busy_frames++;
+    if (pager->shared != NULL)
+        shared_drop_pages(pager, page_num, 1);
+    pthread_mutex_unlock(&pager->lock);
+
+    struct iovec iovec = {victim->data, pager->page_size};
+    pager_write_pages(pager, page_num, &iovec, 1);
+
+    pthread_mutex_lock(&pager->lock);
+    pager_count_write(pager, page_num, 1);
 }
 
-bool is_node_root(void *node)
+/* a busy frame is usable again; wake whoever waits for it */
+void pager_frame_ready(pager *pager, frame *frame)
 {
-    uint8_t value = *((uint8_t *)((char *)node + IS_ROOT_OFFSET));
-    return (bool)value;
+    atomic_store_explicit(&frame->state, PAGE_READY, memory_order_release);
+    pager->busy_frames--;
+    pthread_cond_broadcast(&pager->frame_ready);
 }
 
-void set_node_root(void *node, bool is_root)
+/* take the frame off its bucket chain */
+void pager_unlink_frame(pager *pager, int32_t index)
 {
-    uint8_t value = is_root ? 1 : 0;
-    *((uint8_t *)((char *)node + IS_ROOT_OFFSET)) = value;
+    frame *frame = &pager->frames[index];
+    int32_t *link = &pager->buckets[pager_hash(frame->page_num)];
+    while (*link != index)
+        link = &pager->frames[*link].hash_next;
+    *link = frame->hash_next;
+    frame->hash_next = -1;
 }
 
-/* --- Internal node helpers --- */
-uint32_t *internal_node_num_keys(void *node)
+/* Forget a clean cached page that another process has changed since; the
+   frame is reused like any other. */
+void pager_forget(pager *pager, int32_t index)
 {
-    return (uint32_t *)((char *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+    pager_unlink_frame(pager, index);
+    pager->frames[index].page_num = INVALID_PAGE_NUM;
+    pager->frames[index].referenced = false;
 }
 
-uint32_t *internal_node_right_child(void *node)
+/* Find a frame for a page that is not cached: an unused one, or evict a page
+   nobody can still hold a pointer to (writing it back first if dirty).
+   Returns -1 when every cached page was used since the last unpin or is
+   latched. The caller holds pager->lock. With dropped_lock, a dirty page is
+   written back with the lock released, *dropped_lock is set and the frame
+   comes back busy; without it the write happens under the lock. */
+int32_t pager_allocate_frame(pager *pager, bool *dropped_lock)
 {
-    return (uint32_t *)((char *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+    if (pager->frames_used < PAGER_CACHE_PAGES)
+        return (int32_t)pager->frames_used++;
+
+    for (uint32_t scanned = 0; scanned < 2 * PAGER_CACHE_PAGES; scanned++)
+    {
+        int32_t index = (int32_t)pager->clock_hand;
+        frame *victim = &pager->frames[index];
+        pager->clock_hand = (pager->clock_hand + 1) % PAGER_CACHE_PAGES;
+
+        if (victim->last_used >= pager->epoch ||
+            atomic_load_explicit(&victim->pin_count, memory_order_acquire) != 0 ||
+            atomic_load_explicit(&victim->state, memory_order_acquire) != PAGE_READY)
+            continue;
+        if (victim->referenced)
+        {
+            victim->referenced = false;
+            continue;
+        }
+
+        if (victim->dirty && dropped_lock != NULL)
+        {
+            pager_write_back_unlocked(pager, victim);
+            *dropped_lock = true;
+        }
+        else if (victim->dirty)
+        {
+            pager_write_frame(pager, victim);
+        }
+
+        if (victim->page_num != INVALID_PAGE_NUM)
+            pager_unlink_frame(pager, index);
+        return index;
+    }
+    return -1;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+/* hand a freshly allocated frame to page_num */
+void pager_install_frame(pager *pager, int32_t index, uint64_t page_num)
 {
-    return (uint32_t *)((char *)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+    frame *frame = &pager->frames[index];
+    uint32_t bucket = pager_hash(page_num);
+    frame->page_num = page_num;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->last_used = pager->epoch;
+    frame->hash_next = pager->buckets[bucket];
+    pager->buckets[bucket] = index;
+    if (page_num >= pager->num_pages)
+        pager->num_pages = page_num + 1;
 }
 
-uint32_t *internal_node_child(void *node, uint32_t child_num)
+/* Frame holding page_num, read in if needed. The caller holds pager->lock,
+   which is released while the page is read or a dirty victim written back,
+   so other threads only wait if they want one of those two pages. */
+int32_t pager_fetch(pager *pager, uint64_t page_num)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys)
+    int32_t index = pager_lookup(pager, page_num);
+    while (index != -1 && atomic_load_explicit(&pager->frames[index].state, memory_order_acquire) == PAGE_BUSY)
     {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
+        pthread_cond_wait(&pager->frame_ready, &pager->lock);
+        index = pager_lookup(pager, page_num);
     }
-    else if (child_num == num_keys)
+
+    if (index == -1)
     {
-        uint32_t *right_child = internal_node_right_child(node);
-        if (*right_child == INVALID_PAGE_NUM)
+        bool dropped_lock = false;
+        index = pager_allocate_frame(pager, &dropped_lock);
+        if (index == -1 && pager->readahead != NULL)
         {
-            printf("Tried to access right child of node, but was invalid page\n");
-            exit(EXIT_FAILURE);
+            /* prefetched pages cannot be evicted until they have landed */
+            for (uint32_t i = 0; i < pager->frames_used; i++)
+            {
+                if (atomic_load_explicit(&pager->frames[i].state, memory_order_acquire) == PAGE_LOADING)
+                    readahead_wait(pager, i);
+            }
+            index = pager_allocate_frame(pager, &dropped_lock);
         }
-        return right_child;
-    }
-    else
-    {
-        uint32_t *child = internal_node_cell(node, child_num);
-        if (*child == INVALID_PAGE_NUM)
+        if (index == -1 && pager->writer != NULL && pager->writer->in_flight > 0)
         {
-            printf("Tried to access child %d of node, but was invalid page\n", child_num);
+            /* the background writer's batch stays pinned until it lands */
+            pthread_mutex_unlock(&pager->lock);
+            pthread_mutex_lock(&pager->write_lock);
+            pthread_mutex_unlock(&pager->write_lock);
+            pthread_mutex_lock(&pager->lock);
+            return pager_fetch(pager, page_num);
+        }
+        if (index == -1 && pager->busy_frames > 0)
+        {
+            /* other threads' reads and write-backs free up frames too */
+            pthread_cond_wait(&pager->frame_ready, &pager->lock);
+            return pager_fetch(pager, page_num);
+        }
+        if (index == -1)
+        {
+            printf("Page cache exhausted: more than %d pages in use\n", PAGER_CACHE_PAGES);
             exit(EXIT_FAILURE);
         }
-        return child;
+        frame *frame = &pager->frames[index];
+        if (dropped_lock && pager_lookup(pager, page_num) != -1)
+        {
+            /* another thread read the page in while the victim was written */
+            frame->page_num = INVALID_PAGE_NUM;
+            frame->referenced = false;
+            pager_frame_ready(pager, frame);
+            return pager_fetch(pager, page_num);
+        }
+        char *page = frame->data;
+
+        /* only what the file does not cover is zeroed; another process
+           may have made the file longer than this one has seen */
+        uint32_t page_size = pager->page_size;
+        uint64_t num_pages = (pager->file_length + page_size - 1) / page_size;
+        bool busy = atomic_load_explicit(&frame->state, memory_order_relaxed) == PAGE_BUSY;
+        pager_install_frame(pager, index, page_num);
+        if (pager->shared != NULL && shared_read_page(pager, page_num, page))
+        {
+            if (pager->trace != NULL)
+                pager->trace->shared_hits++;
+        }
+        else if (page_num < num_pages || pager->shared != NULL)
+        {
+            /* threads that want this page wait for it; everyone else goes on */
+            if (!busy)
+            {
+                atomic_store_explicit(&frame->state, PAGE_BUSY, memory_order_relaxed);
+                pager->busy_frames++;
+                busy = true;
+            }
+            pthread_mutex_unlock(&pager->lock);
+            ssize_t bytes_read = pread(pager->file_descriptor, page, page_size, (off_t)page_num * page_size);
+            if (bytes_read == -1)
+            {
+                printf("Error reading file: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            if (bytes_read < page_size)
+                memset(page + bytes_read, 0, page_size - bytes_read);
+            pthread_mutex_lock(&pager->lock);
+
+            pager->pages_read++;
+            if (pager->trace != NULL)
+                pager->trace->disk_reads++;
+            if (pager->shared != NULL && bytes_read == page_size)
+                shared_offer_page(pager, page_num, page);
+        }
+        else
+        {
+            memset(page, 0, page_size);
+            if (pager->trace != NULL)
+                pager->trace->new_pages++;
+        }
+        if (busy)
+            pager_frame_ready(pager, frame);
+    }
+    else if (atomic_load_explicit(&pager->frames[index].state, memory_order_acquire) != PAGE_READY)
+    {
+        if (pager->trace != NULL)
+            pager->trace->readahead_waits++;
+        readahead_wait(pager, (uint32_t)index);
+    }
+    else if (pager->trace != NULL)
+    {
+        pager->trace->cache_hits++;
     }
+    pager->frames[index].referenced = true;
+    return index;
 }
 
-uint32_t *node_parent(void *node)
+void *get_page(pager *pager, uint64_t page_num)
 {
-    return (uint32_t *)((char *)node + PARENT_POINTER_OFFSET);
+    pthread_mutex_lock(&pager->lock);
+    frame *frame = &pager->frames[pager_fetch(pager, page_num)];
+    frame->last_used = pager->epoch;
+    pthread_mutex_unlock(&pager->lock);
+    return frame->data;
 }
 
-/* pointer arithmetic: add bytes to pointer (work with char*) */
-uint32_t *internal_node_key(void *node, uint32_t key_num)
+/* Page pointers handed out so far are no longer in use; their pages may be
+   evicted from now on. Called between statements and between scanned leaves.
+   Pages latched by other threads stay put. */
+void pager_unpin_all(pager *pager)
 {
-    return (uint32_t *)((char *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+    pthread_mutex_lock(&pager->lock);
+    pager->epoch++;
+    pthread_mutex_unlock(&pager->lock);
 }
 
-void initialize_internal_node(void *node)
+/* Pin a page and latch it shared or exclusive, for threads that share the
+   pager. Latches are always taken parent before child, so they cannot
+   deadlock; the pin keeps the page cached until pager_unlatch. */
+frame *pager_latch(pager *pager, uint64_t page_num, bool exclusive)
 {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
-    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+    pthread_mutex_lock(&pager->lock);
+    frame *frame = &pager->frames[pager_fetch(pager, page_num)];
+    atomic_fetch_add_explicit(&frame->pin_count, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&pager->lock);
+
+    if (exclusive)
+        pthread_rwlock_wrlock(&frame->latch);
+    else
+        pthread_rwlock_rdlock(&frame->latch);
+    return frame;
 }
 
-/* get_node_max_key walking down right children until leaf */
-uint32_t get_node_max_key(pager *pager, void *node)
+void pager_unlatch(frame *frame)
 {
-    if (get_node_type(node) == NODE_LEAF)
-    {
-        uint32_t num_cells = *leaf_node_num_cells(node);
-        if (num_cells == 0)
-            return 0;
-        return *leaf_node_key(node, num_cells - 1);
+    pthread_rwlock_unlock(&frame->latch);
+    atomic_fetch_sub_explicit(&frame->pin_count, 1, memory_order_release);
+}
+
+/* the page number is taken at once, so concurrent splits never share one */
+uint64_t get_unused_page_num(pager *pager)
+{
+    pthread_mutex_lock(&pager->lock);
+    uint64_t page_num = pager->num_pages++;
+    pthread_mutex_unlock(&pager->lock);
+    return page_num;
+}
+
+/* Call before changing a page; only dirty pages are written back. */
+void pager_mark_dirty(pager *pager, uint64_t page_num)
+{
+    pthread_mutex_lock(&pager->lock);
+    int32_t index = pager_lookup(pager, page_num);
+    if (index == -1)
+    {
+        printf("Tried to dirty page %" PRIu64 " which is not cached\n", page_num);
+        exit(EXIT_FAILURE);
     }
-    else
+    if (pager->backup != NULL && !atomic_load_explicit(&pager->backup->finished, memory_order_acquire))
+        backup_save_page(pager->backup, page_num, pager->frames[index].data);
+    frame *frame = &pager->frames[index];
+    if (!frame->dirty)
     {
-        uint32_t right_child_page = *internal_node_right_child(node);
-        void *right_child = get_page(pager, right_child_page);
-        return get_node_max_key(pager, right_child);
+        frame->dirty = true;
+        frame->dirtied_at = pager->dirty_sequence++;
+        atomic_fetch_add_explicit(&pager->dirty_pages, 1, memory_order_relaxed);
+        if (pager->shared != NULL)
+            shared_touch(pager->shared, page_num);
     }
+    pthread_mutex_unlock(&pager->lock);
 }
 
-/* --- update parent key helper --- */
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+/* --- Shared cache ---
+   With --shared, every process that opens the file maps a second page cache
+   from <db>-shm. A page that another process has already read or changed is
+   copied from there instead of read from the file.
+
+   Byte-range locks on the -shm file order the processes:
+     SHARED_LOCK_OPEN       held shared by each process that has the file
+                            open; one that gets it exclusively is alone and
+                            starts the file over
+     SHARED_LOCK_PENDING    taken exclusively by a writer before it waits, so
+                            new readers queue behind it
+     SHARED_LOCK_STATEMENT  held shared by each running read statement, or
+                            exclusively by the one running write statement
+   A write statement changes its own frames as usual. When it ends, every
+   page it dirtied is copied into the shared cache and its number is logged;
+   the other processes drop their stale copies before their next statement.
+   The slots, chains and log are guarded by a robust process-shared mutex.
+   If a process dies holding it, the next one to lock it drops the slot that
+   was being filled and rebuilds the chains. */
+uint32_t shared_hash(uint64_t page_num)
 {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+    return (uint32_t)((page_num * 0x9E3779B97F4A7C15ull) >> (64 - SHARED_HASH_BITS));
 }
 
-/* --- leaf split/insert --- */
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
-
-void leaf_node_split_and_insert(cursor *cursor, uint32_t key, row *value)
+char *shared_slot_page(sharedcache *shared, int32_t index)
 {
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
+    return shared->pages + (size_t)index * shared->header->page_size;
+}
 
-    for (int32_t i = (int32_t)LEAF_NODE_MAX_CELLS; i >= 0; i--)
+/* Take, change or drop a lock on one byte of the -shm file. Without wait,
+   returns false at once if another process holds a conflicting lock. */
+bool shared_file_lock(sharedcache *shared, off_t byte, short type, bool wait)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = byte;
+    lock.l_len = 1;
+    while (fcntl(shared->file_descriptor, wait ? F_SETLKW : F_SETLK, &lock) == -1)
     {
-        void *destination_node;
-        if ((uint32_t)i >= LEAF_NODE_LEFT_SPLIT_COUNT)
-        {
-            destination_node = new_node;
-        }
-        else
+        if (!wait && (errno == EACCES || errno == EAGAIN))
+            return false;
+        if (errno != EINTR)
         {
-            destination_node = old_node;
+            printf("Unable to lock the shared cache: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
+    }
+    return true;
+}
 
-        uint32_t index_within_node = (uint32_t)i;
-        if ((uint32_t)i >= LEAF_NODE_LEFT_SPLIT_COUNT)
-        {
-            index_within_node = (uint32_t)i - LEAF_NODE_LEFT_SPLIT_COUNT;
-        }
+/* Make the cache consistent again after a process died holding its lock. */
+void shared_recover(sharedheader *header)
+{
+    if (header->busy_slot != -1)
+    {
+        header->slots[header->busy_slot].page_num = INVALID_PAGE_NUM;
+        header->slots[header->busy_slot].dirty = false;
+        header->busy_slot = -1;
+    }
+    for (uint32_t i = 0; i < SHARED_HASH_BUCKETS; i++)
+        header->buckets[i] = -1;
+    for (int32_t i = 0; i < SHARED_CACHE_PAGES; i++)
+    {
+        sharedslot *slot = &header->slots[i];
+        if (slot->page_num == INVALID_PAGE_NUM)
+            continue;
+        uint32_t bucket = shared_hash(slot->page_num);
+        slot->hash_next = header->buckets[bucket];
+        header->buckets[bucket] = i;
+    }
+    header->recoveries++;
+}
 
-        void *destination = leaf_node_cell(destination_node, index_within_node);
+void shared_lock(sharedcache *shared)
+{
+    int result = pthread_mutex_lock(&shared->header->lock);
+    if (result == EOWNERDEAD)
+    {
+        shared_recover(shared->header);
+        pthread_mutex_consistent(&shared->header->lock);
+    }
+    else if (result != 0)
+    {
+        printf("Unable to lock the shared cache: %d\n", result);
+        exit(EXIT_FAILURE);
+    }
+}
 
-        if ((uint32_t)i == cursor->cell_num)
-        {
-            *leaf_node_key(destination_node, index_within_node) = key;
-            serialize_row(value, leaf_node_value(destination_node, index_within_node));
-        }
-        else if ((uint32_t)i > cursor->cell_num)
+void shared_unlock(sharedcache *shared)
+{
+    pthread_mutex_unlock(&shared->header->lock);
+}
+
+sharedcache *shared_open(pager *pager, const char *filename)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-shm", filename);
+    int fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (fd == -1)
+    {
+        printf("Unable to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    sharedcache *shared = calloc(1, sizeof(*shared));
+    shared->file_descriptor = fd;
+    size_t pages_offset = (sizeof(sharedheader) + pager->page_size - 1) / pager->page_size * pager->page_size;
+    shared->size = pages_offset + (size_t)SHARED_CACHE_PAGES * pager->page_size;
+
+    /* the first process in empties the file; the others wait until it has */
+    bool alone = shared_file_lock(shared, SHARED_LOCK_OPEN, F_WRLCK, false);
+    struct stat status;
+    if (alone)
+    {
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)shared->size) == -1)
         {
-            memcpy(destination, leaf_node_cell(old_node, (uint32_t)i - 1), LEAF_NODE_CELL_SIZE);
+            printf("Unable to size %s\n", path);
+            exit(EXIT_FAILURE);
         }
-        else
+    }
+    else
+    {
+        shared_file_lock(shared, SHARED_LOCK_OPEN, F_RDLCK, true);
+        if (fstat(fd, &status) == -1 || (size_t)status.st_size != shared->size)
         {
-            memcpy(destination, leaf_node_cell(old_node, (uint32_t)i), LEAF_NODE_CELL_SIZE);
+            printf("%s is in use with a different page size.\n", path);
+            exit(EXIT_FAILURE);
         }
     }
+    void *mapping = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        printf("Unable to map %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    shared->header = mapping;
+    shared->pages = (char *)mapping + pages_offset;
 
-    *leaf_node_num_cells(old_node) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *leaf_node_num_cells(new_node) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if (is_node_root(old_node))
+    sharedheader *header = shared->header;
+    if (alone)
     {
-        create_new_root(cursor->table, new_page_num);
-        return;
+        memcpy(header->magic, SHARED_MAGIC, SHARED_MAGIC_SIZE);
+        header->page_size = pager->page_size;
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->lock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        header->busy_slot = -1;
+        for (uint32_t i = 0; i < SHARED_HASH_BUCKETS; i++)
+            header->buckets[i] = -1;
+        for (uint32_t i = 0; i < SHARED_CACHE_PAGES; i++)
+        {
+            header->slots[i].page_num = INVALID_PAGE_NUM;
+            header->slots[i].hash_next = -1;
+        }
+        shared_file_lock(shared, SHARED_LOCK_OPEN, F_RDLCK, true);
     }
-    else
+    else if (memcmp(header->magic, SHARED_MAGIC, SHARED_MAGIC_SIZE) != 0 || header->page_size != pager->page_size)
     {
-        uint32_t parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-        void *parent = get_page(cursor->table->pager, parent_page_num);
-
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
-        return;
+        printf("%s is in use with a different page size.\n", path);
+        exit(EXIT_FAILURE);
     }
+
+    /* nothing is cached here yet, so older changes do not matter */
+    shared_lock(shared);
+    shared->seen = header->sequence;
+    shared_unlock(shared);
+    return shared;
 }
 
-/* --- Cursor / find helpers --- */
-cursor *table_start(table *table)
+/* Unmap the cache; closing the file lets go of this process's locks. */
+void shared_close(pager *pager)
 {
-    cursor *cursor = table_find(table, 0);
-
-    void *node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
+    sharedcache *shared = pager->shared;
+    munmap(shared->header, shared->size);
+    close(shared->file_descriptor);
+    free(shared->touched);
+    free(shared);
+    pager->shared = NULL;
+}
 
-    return cursor;
+/* slot holding page_num, or -1 if it is not cached */
+int32_t shared_find(sharedheader *header, uint64_t page_num)
+{
+    int32_t index = header->buckets[shared_hash(page_num)];
+    while (index != -1 && header->slots[index].page_num != page_num)
+        index = header->slots[index].hash_next;
+    return index;
 }
 
-/* forward-declare internal_node_find_child prior to using in other functions */
-uint32_t internal_node_find_child(void *node, uint32_t key)
+/* take the slot off its chain and free it */
+void shared_unlink(sharedheader *header, int32_t index)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
+    sharedslot *slot = &header->slots[index];
+    int32_t *link = &header->buckets[shared_hash(slot->page_num)];
+    while (*link != index)
+        link = &header->slots[*link].hash_next;
+    *link = slot->hash_next;
+    slot->hash_next = -1;
+    slot->page_num = INVALID_PAGE_NUM;
+    slot->dirty = false;
+}
 
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; /* there is one more child than key */
+/* Write a slot's page back to the file; the caller holds the lock. */
+void shared_write_slot(pager *pager, int32_t index)
+{
+    sharedslot *slot = &pager->shared->header->slots[index];
+    char *page = shared_slot_page(pager->shared, index);
+    if (slot->page_num != 0)
+        *node_generation(page) = pager->generation;
+    struct iovec iovec = {page, pager->page_size};
+    pager_write_pages(pager, slot->page_num, &iovec, 1);
+    pager->pages_written++;
+    pager->write_calls++;
+    slot->dirty = false;
+}
 
-    while (min_index != max_index)
+/* A slot for a page that is not in the cache: a free one, or the next one
+   the clock finds unreferenced, written back first if dirty. */
+int32_t shared_allocate_slot(pager *pager)
+{
+    sharedheader *header = pager->shared->header;
+    while (true)
     {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key)
-        {
-            max_index = index;
-        }
-        else
+        int32_t index = (int32_t)header->clock_hand;
+        sharedslot *slot = &header->slots[index];
+        header->clock_hand = (header->clock_hand + 1) % SHARED_CACHE_PAGES;
+        if (slot->page_num == INVALID_PAGE_NUM)
+            return index;
+        if (slot->referenced)
         {
-            min_index = index + 1;
+            slot->referenced = false;
+            continue;
         }
+        if (slot->dirty)
+            shared_write_slot(pager, index);
+        shared_unlink(header, index);
+        return index;
     }
-    return min_index;
 }
 
-/* internal_node_find: find cursor for a key under an internal node (walk tree) */
-cursor *internal_node_find(table *table, uint32_t page_num, uint32_t key)
+/* Store a copy of a page; the caller holds the lock. A dirty slot stays
+   dirty, since any newer write to the file would have dropped it. */
+void shared_put(pager *pager, uint64_t page_num, const void *page, bool dirty)
 {
-    void *node = get_page(table->pager, page_num);
-
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child))
+    sharedheader *header = pager->shared->header;
+    int32_t index = shared_find(header, page_num);
+    if (index == -1)
     {
-    case NODE_LEAF:
-        return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-        return internal_node_find(table, child_num, key);
-    default:
-        printf("Unknown node type in internal_node_find\n");
-        exit(EXIT_FAILURE);
+        index = shared_allocate_slot(pager);
+        header->busy_slot = index;
+        uint32_t bucket = shared_hash(page_num);
+        header->slots[index].page_num = page_num;
+        header->slots[index].hash_next = header->buckets[bucket];
+        header->buckets[bucket] = index;
     }
+    header->busy_slot = index;
+    memcpy(shared_slot_page(pager->shared, index), page, pager->page_size);
+    header->slots[index].dirty |= dirty;
+    header->slots[index].referenced = true;
+    header->busy_slot = -1;
 }
 
-cursor *table_find(table *table, uint32_t key)
+void shared_log(sharedheader *header, uint64_t page_num)
 {
-    uint32_t root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
+    header->changes[header->sequence % SHARED_CHANGE_LOG] = page_num;
+    header->sequence++;
+}
 
-    if (get_node_type(root_node) == NODE_LEAF)
+/* Copy page_num out of the shared cache; false if it is not there. */
+bool shared_read_page(pager *pager, uint64_t page_num, void *destination)
+{
+    sharedcache *shared = pager->shared;
+    shared_lock(shared);
+    int32_t index = shared_find(shared->header, page_num);
+    if (index != -1)
     {
-        return leaf_node_find(table, root_page_num, key);
+        memcpy(destination, shared_slot_page(shared, index), pager->page_size);
+        shared->header->slots[index].referenced = true;
     }
+    shared_unlock(shared);
+    if (index != -1)
+        shared->hits++;
     else
-    {
-        return internal_node_find(table, root_page_num, key);
-    }
+        shared->misses++;
+    return index != -1;
 }
 
-cursor *leaf_node_find(table *table, uint32_t page_num, uint32_t key)
+/* a page just read from the file, kept for the next process that wants it */
+void shared_offer_page(pager *pager, uint64_t page_num, const void *page)
 {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    cursor *cursor = malloc(sizeof(cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+    shared_lock(pager->shared);
+    if (shared_find(pager->shared->header, page_num) == -1)
+        shared_put(pager, page_num, page, false);
+    shared_unlock(pager->shared);
+}
 
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (one_past_max_index != min_index)
+/* This process is about to write the pages to the file, so whatever the
+   shared cache holds of them is stale. The others are told to drop their
+   copies too. */
+void shared_drop_pages(pager *pager, uint64_t first_page_num, uint32_t count)
+{
+    sharedheader *header = pager->shared->header;
+    shared_lock(pager->shared);
+    for (uint32_t i = 0; i < count; i++)
     {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index)
-        {
-            cursor->cell_num = index;
-            return cursor;
-        }
-        if (key < key_at_index)
-        {
-            one_past_max_index = index;
-        }
-        else
-        {
-            min_index = index + 1;
-        }
+        int32_t index = shared_find(header, first_page_num + i);
+        if (index != -1)
+            shared_unlink(header, index);
+        shared_log(header, first_page_num + i);
     }
+    shared_unlock(pager->shared);
+}
 
-    cursor->cell_num = min_index;
-    return cursor;
+/* remember a page the running write statement dirtied; under pager->lock */
+void shared_touch(sharedcache *shared, uint64_t page_num)
+{
+    if (shared->num_touched == shared->touched_capacity)
+    {
+        shared->touched_capacity = shared->touched_capacity > 0 ? shared->touched_capacity * 2 : 64;
+        shared->touched = realloc(shared->touched, shared->touched_capacity * sizeof(uint64_t));
+    }
+    shared->touched[shared->num_touched++] = page_num;
 }
 
-void *cursor_value(cursor *c)
+/* Write every page the shared cache holds newer than the file. */
+void shared_write_back(pager *pager)
 {
-    return leaf_node_value(get_page(c->table->pager, c->page_num), c->cell_num);
+    shared_lock(pager->shared);
+    for (int32_t i = 0; i < SHARED_CACHE_PAGES; i++)
+    {
+        if (pager->shared->header->slots[i].dirty)
+            shared_write_slot(pager, i);
+    }
+    shared_unlock(pager->shared);
 }
 
-void cursor_advance(cursor *cursor)
+/* Start a statement: wait for the statement lock, shared to read and
+   exclusive to write, then forget the cached pages that other processes
+   have changed since. Says whether anything changed, and whether
+   watch_page_num was among it. */
+sharedchanges pager_shared_begin(pager *pager, bool write, uint64_t watch_page_num)
 {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    sharedcache *shared = pager->shared;
+    if (write)
     {
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0)
+        shared_file_lock(shared, SHARED_LOCK_PENDING, F_WRLCK, true);
+        shared_file_lock(shared, SHARED_LOCK_STATEMENT, F_WRLCK, true);
+    }
+    else
+    {
+        shared_file_lock(shared, SHARED_LOCK_PENDING, F_RDLCK, true);
+        shared_file_lock(shared, SHARED_LOCK_STATEMENT, F_RDLCK, true);
+        shared_file_lock(shared, SHARED_LOCK_PENDING, F_UNLCK, true);
+    }
+    shared->writing = write;
+    shared->num_touched = 0;
+
+    sharedchanges changes = SHARED_UNCHANGED;
+    pthread_mutex_lock(&pager->lock);
+    shared_lock(shared);
+    sharedheader *header = shared->header;
+    if (header->num_pages > pager->num_pages)
+        pager->num_pages = header->num_pages;
+    if (header->sequence - shared->seen > SHARED_CHANGE_LOG)
+    {
+        /* too far behind to know which pages changed */
+        for (int32_t i = 0; i < (int32_t)pager->frames_used; i++)
         {
-            cursor->end_of_table = true;
+            if (pager->frames[i].page_num != INVALID_PAGE_NUM && !pager->frames[i].dirty)
+            {
+                pager_forget(pager, i);
+                shared->forgotten++;
+            }
         }
-        else
+        changes = SHARED_CHANGED_WATCHED;
+    }
+    else
+    {
+        for (uint64_t n = shared->seen; n < header->sequence; n++)
         {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+            uint64_t page_num = header->changes[n % SHARED_CHANGE_LOG];
+            int32_t index = pager_lookup(pager, page_num);
+            if (index != -1 && !pager->frames[index].dirty)
+            {
+                pager_forget(pager, index);
+                shared->forgotten++;
+            }
+            if (changes != SHARED_CHANGED_WATCHED)
+                changes = page_num == watch_page_num ? SHARED_CHANGED_WATCHED : SHARED_CHANGED;
         }
     }
+    shared->seen = header->sequence;
+    shared_unlock(shared);
+    pthread_mutex_unlock(&pager->lock);
+    return changes;
 }
 
-/* --- Table open / root init --- */
-table *db_open(const char *filename)
+/* End a statement. A write first copies each page it changed into the
+   shared cache, where the next statement of any process finds it. */
+void pager_shared_end(pager *pager)
 {
-    pager *pager = pager_open(filename);
-    table *table = malloc(sizeof(table));
-    table->pager = pager;
-    table->root_page_num = 0;
-
-    if (pager->num_pages == 0)
+    sharedcache *shared = pager->shared;
+    if (shared->writing)
     {
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+        pthread_mutex_lock(&pager->lock);
+        shared_lock(shared);
+        sharedheader *header = shared->header;
+        for (uint32_t i = 0; i < shared->num_touched; i++)
+        {
+            uint64_t page_num = shared->touched[i];
+            int32_t index = pager_lookup(pager, page_num);
+            if (index == -1)
+                continue; /* evicted, so written to the file and logged then */
+            frame *frame = &pager->frames[index];
+            shared_put(pager, page_num, frame->data, frame->dirty);
+            shared_log(header, page_num);
+            shared->published++;
+            if (frame->dirty)
+            {
+                /* the shared cache writes it back from now on */
+                frame->dirty = false;
+                atomic_fetch_sub_explicit(&pager->dirty_pages, 1, memory_order_relaxed);
+            }
+        }
+        shared->num_touched = 0;
+        if (pager->num_pages > header->num_pages)
+            header->num_pages = pager->num_pages;
+        shared->seen = header->sequence;
+        shared_unlock(shared);
+        pthread_mutex_unlock(&pager->lock);
     }
-
-    return table;
+    shared_file_lock(shared, SHARED_LOCK_STATEMENT, F_UNLCK, true);
+    if (shared->writing)
+        shared_file_lock(shared, SHARED_LOCK_PENDING, F_UNLCK, true);
+    shared->writing = false;
 }
 
-/* --- create_new_root: updated to handle internal children --- */
-void create_new_root(table *table, uint32_t right_child_page_num)
+void print_shared_stats(pager *pager)
 {
-    void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
-
-    if (get_node_type(root) == NODE_INTERNAL)
+    sharedcache *shared = pager->shared;
+    uint32_t used = 0, dirty = 0;
+    shared_lock(shared);
+    for (uint32_t i = 0; i < SHARED_CACHE_PAGES; i++)
     {
-        initialize_internal_node(right_child);
-        initialize_internal_node(left_child);
+        used += shared->header->slots[i].page_num != INVALID_PAGE_NUM;
+        dirty += shared->header->slots[i].dirty;
     }
+    uint64_t recoveries = shared->header->recoveries;
+    shared_unlock(shared);
+    printf("Shared cache: %u of %d pages in use, %u dirty; %" PRIu64 " pages copied from it, %" PRIu64
+           " not found, %" PRIu64 " published, %" PRIu64 " stale copies dropped\n",
+           used, SHARED_CACHE_PAGES, dirty, shared->hits, shared->misses, shared->published, shared->forgotten);
+    if (recoveries > 0)
+        printf("Shared cache recovered after %" PRIu64 " processes died holding its lock\n", recoveries);
+}
 
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+/* --- Readahead --- */
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+bool io_uring_open(iouring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return false; /* ENOSYS, or blocked by seccomp/sysctl */
+
+    ring->ring_fd = ring_fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
 
-    if (get_node_type(left_child) == NODE_INTERNAL)
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring_fd);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
     {
-        void *child;
-        for (int i = 0; i < *internal_node_num_keys(left_child); i++)
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
         {
-            child = get_page(table->pager, *internal_node_child(left_child, i));
-            *node_parent(child) = left_child_page_num;
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring_fd);
+            return false;
         }
-        child = get_page(table->pager, *internal_node_right_child(left_child));
-        *node_parent(child) = left_child_page_num;
     }
 
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring_fd);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
 }
 
-/* --- internal_node_insert: inserts child into parent (splits if needed) --- */
-void internal_node_insert(table *table, uint32_t parent_page_num, uint32_t child_page_num)
+void io_uring_close(iouring *ring)
 {
-    void *parent = get_page(table->pager, parent_page_num);
-    void *child = get_page(table->pager, child_page_num);
-    uint32_t child_max_key = get_node_max_key(table->pager, child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
 
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
+/* queue a read of one page into a frame; the caller submits with io_uring_enter */
+void io_uring_queue_read(iouring *ring, int fd, uint64_t page_num, uint32_t page_size, uint32_t frame_index,
+                         void *buffer)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->iovecs[frame_index].iov_base = buffer;
+    ring->iovecs[frame_index].iov_len = page_size;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = page_num * page_size;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->iovecs[frame_index];
+    sqe->len = 1;
+    sqe->user_data = frame_index;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
-    {
-        internal_node_split_and_insert(table, parent_page_num, child_page_num);
-        return;
-    }
+/* mark every finished read ready; blocks for at least one if wait is set */
+void io_uring_reap(pager *pager, bool wait)
+{
+    readaheadpool *ra = pager->readahead;
+    iouring *ring = &ra->ring;
 
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    if (wait)
+        syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
 
-    if (right_child_page_num == INVALID_PAGE_NUM)
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
     {
-        *internal_node_right_child(parent) = child_page_num;
-        return;
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint32_t frame_index = (uint32_t)cqe->user_data;
+        unsigned char state = cqe->res < 0 ? PAGE_FAILED : PAGE_READY;
+        if (cqe->res >= 0 && cqe->res < (int32_t)pager->page_size)
+            memset((char *)pager->frames[frame_index].data + cqe->res, 0, pager->page_size - cqe->res);
+        atomic_store_explicit(&pager->frames[frame_index].state, state, memory_order_release);
+        ra->in_flight--;
+        head++;
     }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
 
-    void *right_child = get_page(table->pager, right_child_page_num);
-
-    /* Now safe to increment num_keys */
-    *internal_node_num_keys(parent) = original_num_keys + 1;
+void *readahead_worker(void *argument)
+{
+    pager *pager = argument;
+    readaheadpool *ra = pager->readahead;
 
-    if (child_max_key > get_node_max_key(table->pager, right_child))
+    pthread_mutex_lock(&ra->lock);
+    while (true)
     {
-        /* Replace right child */
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
-        *internal_node_right_child(parent) = child_page_num;
+        while (ra->queue_length == 0 && !ra->shutdown)
+            pthread_cond_wait(&ra->work_ready, &ra->lock);
+        if (ra->queue_length == 0)
+            break;
+
+        readaheadrequest request = ra->queue[ra->queue_head];
+        ra->queue_head = (ra->queue_head + 1) % READAHEAD_MAX_WINDOW;
+        ra->queue_length--;
+        pthread_mutex_unlock(&ra->lock);
+
+        uint32_t page_size = pager->page_size;
+        ssize_t bytes_read = pread(ra->file_descriptor, request.buffer, page_size, (off_t)request.page_num * page_size);
+        if (bytes_read >= 0 && bytes_read < page_size)
+            memset((char *)request.buffer + bytes_read, 0, page_size - bytes_read);
+
+        pthread_mutex_lock(&ra->lock);
+        unsigned char state = bytes_read == -1 ? PAGE_FAILED : PAGE_READY;
+        atomic_store_explicit(&pager->frames[request.frame_index].state, state, memory_order_release);
+        ra->in_flight--;
+        pthread_cond_broadcast(&ra->page_ready);
     }
-    else
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+readaheadpool *readahead_open(pager *pager)
+{
+    readaheadpool *ra = malloc(sizeof(*ra));
+    memset(ra, 0, sizeof(*ra));
+    ra->file_descriptor = pager->file_descriptor;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work_ready, NULL);
+    pthread_cond_init(&ra->page_ready, NULL);
+    pager->readahead = ra;
+
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+    ra->use_io_uring = io_uring_open(&ra->ring, READAHEAD_MAX_WINDOW);
+    if (ra->use_io_uring)
+        return ra;
+#endif
+
+    for (uint32_t i = 0; i < READAHEAD_THREADS; i++)
     {
-        /* Make room for the new cell */
-        for (uint32_t i = original_num_keys; i > index; i--)
-        {
-            void *destination = internal_node_cell(parent, i);
-            void *source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
+        if (pthread_create(&ra->threads[ra->num_threads], NULL, readahead_worker, pager) == 0)
+            ra->num_threads++;
     }
+    return ra;
 }
 
-/* --- internal_node_split_and_insert --- */
-void internal_node_split_and_insert(table *table, uint32_t parent_page_num, uint32_t child_page_num)
+/* Start reading pages that are not cached yet. Never blocks on the disk. */
+void readahead_pages(pager *pager, uint64_t *page_nums, uint32_t count)
 {
-    uint32_t old_page_num = parent_page_num;
-    void *old_node = get_page(table->pager, parent_page_num);
-    uint32_t old_max = get_node_max_key(table->pager, old_node);
+    /* prefetched pages would be read past the shared cache */
+    if (pager->shared != NULL)
+        return;
+    readaheadpool *ra = pager->readahead;
+    if (ra == NULL)
+        ra = readahead_open(pager);
 
-    void *child = get_page(table->pager, child_page_num);
-    uint32_t child_max = get_node_max_key(table->pager, child);
+    uint32_t page_size = pager->page_size;
+    uint64_t pages_on_disk = (pager->file_length + page_size - 1) / page_size;
+    uint32_t queued = 0;
 
-    uint32_t new_page_num = get_unused_page_num(table->pager);
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+    if (ra->use_io_uring)
+        io_uring_reap(pager, false);
+#endif
 
-    uint32_t splitting_root = is_node_root(old_node);
+    pthread_mutex_lock(&pager->lock);
+    if (!ra->use_io_uring)
+        pthread_mutex_lock(&ra->lock);
 
-    void *parent;
-    void *new_node = NULL;
-    if (splitting_root)
+    for (uint32_t i = 0; i < count; i++)
     {
-        create_new_root(table, new_page_num);
-        parent = get_page(table->pager, table->root_page_num);
-        old_page_num = *internal_node_child(parent, 0);
-        old_node = get_page(table->pager, old_page_num);
+        uint64_t page_num = page_nums[i];
+        if (page_num >= pages_on_disk || pager_lookup(pager, page_num) != -1)
+            continue;
+        if (ra->in_flight >= READAHEAD_MAX_WINDOW)
+            break;
+
+        /* never evict a page the statement is using just to prefetch */
+        int32_t frame_index = pager_allocate_frame(pager, NULL);
+        if (frame_index == -1)
+            break;
+        void *page = pager->frames[frame_index].data;
+        atomic_store_explicit(&pager->frames[frame_index].state, PAGE_LOADING, memory_order_relaxed);
+        pager_install_frame(pager, frame_index, page_num);
+        ra->in_flight++;
+        pager->pages_read++;
+        if (pager->trace != NULL)
+            pager->trace->pages_prefetched++;
+        queued++;
+
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+        if (ra->use_io_uring)
+        {
+            io_uring_queue_read(&ra->ring, ra->file_descriptor, page_num, page_size, (uint32_t)frame_index, page);
+            continue;
+        }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+        /* let the kernel start on it even before a worker picks it up */
+        posix_fadvise(ra->file_descriptor, (off_t)page_num * page_size, page_size, POSIX_FADV_WILLNEED);
+#endif
+        uint32_t tail = (ra->queue_head + ra->queue_length) % READAHEAD_MAX_WINDOW;
+        ra->queue[tail].page_num = page_num;
+        ra->queue[tail].frame_index = (uint32_t)frame_index;
+        ra->queue[tail].buffer = page;
+        ra->queue_length++;
     }
-    else
+
+    if (ra->use_io_uring)
     {
-        parent = get_page(table->pager, *node_parent(old_node));
-        new_node = get_page(table->pager, new_page_num);
-        initialize_internal_node(new_node);
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+        if (queued > 0)
+            syscall(__NR_io_uring_enter, ra->ring.ring_fd, queued, 0, 0, NULL, 0);
+#endif
+        pthread_mutex_unlock(&pager->lock);
+        return;
     }
+    if (queued > 0)
+        pthread_cond_broadcast(&ra->work_ready);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_mutex_unlock(&pager->lock);
+}
 
-    uint32_t *old_num_keys = internal_node_num_keys(old_node);
+/* block until an in-flight page has landed */
+void readahead_wait(pager *pager, uint32_t frame_index)
+{
+    readaheadpool *ra = pager->readahead;
+    atomic_uchar *state = &pager->frames[frame_index].state;
 
-    uint32_t cur_page_num = *internal_node_right_child(old_node);
-    if (cur_page_num == INVALID_PAGE_NUM)
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+    if (ra->use_io_uring)
     {
-        /* nothing to move into new node */
+        while (atomic_load_explicit(state, memory_order_acquire) == PAGE_LOADING)
+            io_uring_reap(pager, true);
     }
-    else
+#endif
+    if (!ra->use_io_uring)
     {
-        void *cur = get_page(table->pager, cur_page_num);
-        internal_node_insert(table, new_page_num, cur_page_num);
-        *node_parent(cur) = new_page_num;
+        pthread_mutex_lock(&ra->lock);
+        while (atomic_load_explicit(state, memory_order_acquire) == PAGE_LOADING)
+            pthread_cond_wait(&ra->page_ready, &ra->lock);
+        pthread_mutex_unlock(&ra->lock);
     }
 
-    *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-
-    for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > (int)(INTERNAL_NODE_MAX_CELLS / 2); i--)
+    if (atomic_load_explicit(state, memory_order_acquire) == PAGE_FAILED)
     {
-        uint32_t move_page_num = *internal_node_child(old_node, i);
-        void *cur = get_page(table->pager, move_page_num);
+        printf("Error reading file: page %" PRIu64 "\n", pager->frames[frame_index].page_num);
+        exit(EXIT_FAILURE);
+    }
+}
 
-        internal_node_insert(table, new_page_num, move_page_num);
-        *node_parent(cur) = new_page_num;
+/* wait for outstanding reads and stop the workers */
+void readahead_close(pager *pager)
+{
+    readaheadpool *ra = pager->readahead;
+    if (ra == NULL)
+        return;
 
-        (*old_num_keys)--;
+#if defined(__linux__) && !defined(READAHEAD_NO_IO_URING)
+    if (ra->use_io_uring)
+    {
+        while (ra->in_flight > 0)
+            io_uring_reap(pager, true);
+        io_uring_close(&ra->ring);
+    }
+#endif
+    if (!ra->use_io_uring)
+    {
+        pthread_mutex_lock(&ra->lock);
+        ra->shutdown = true;
+        pthread_cond_broadcast(&ra->work_ready);
+        pthread_mutex_unlock(&ra->lock);
+        for (uint32_t i = 0; i < ra->num_threads; i++)
+            pthread_join(ra->threads[i], NULL);
     }
 
-    /* Set child before middle key as right child */
-    *internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
-    (*old_num_keys)--;
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->work_ready);
+    pthread_cond_destroy(&ra->page_ready);
+    free(ra);
+    pager->readahead = NULL;
+}
+
+/* --- Backup --- */
+bool backup_page_copied(backup *backup, uint64_t page_num)
+{
+    return backup->copied[page_num / 8] & (1u << (page_num % 8));
+}
+
+/* Copies the snapshot pages in file order, the header last so an interrupted
+   backup never claims a generation it does not hold. */
+void *backup_worker(void *argument)
+{
+    backup *backup = argument;
+    uint32_t page_size = backup->page_size;
+    void *buffer = aligned_alloc(page_size, page_size); /* the source may be O_DIRECT */
+
+    for (uint64_t i = 1; i <= backup->snapshot_pages && !backup->failed; i++)
+    {
+        uint64_t page_num = i % backup->snapshot_pages;
+
+        /* a saved image or an unchanged page in the file, never a newer write */
+        pthread_mutex_lock(&backup->lock);
+        void *page = backup->saved[page_num];
+        backup->saved[page_num] = NULL;
+        if (page == NULL)
+        {
+            ssize_t bytes_read = pread(backup->source_descriptor, buffer, page_size, (off_t)page_num * page_size);
+            if (bytes_read == -1)
+                backup->failed = true;
+            else if (bytes_read < page_size)
+                memset((char *)buffer + bytes_read, 0, page_size - bytes_read);
+        }
+        backup->copied[page_num / 8] |= 1u << (page_num % 8);
+        pthread_mutex_unlock(&backup->lock);
 
-    uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-    uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+        void *source = page != NULL ? page : buffer;
+        bool unchanged = backup->incremental && page_num != 0 && *node_generation(source) <= backup->base_generation;
+        if (!backup->failed && !unchanged)
+        {
+            if (pwrite(backup->file_descriptor, source, page_size, (off_t)page_num * page_size) != page_size)
+                backup->failed = true;
+            else
+                atomic_fetch_add(&backup->pages_copied, 1);
+        }
+        free(page);
+        atomic_fetch_add(&backup->pages_scanned, 1);
+    }
 
-    internal_node_insert(table, destination_page_num, child_page_num);
-    *node_parent(child) = destination_page_num;
+    if (!backup->failed && (ftruncate(backup->file_descriptor, (off_t)backup->snapshot_pages * page_size) == -1 ||
+                            fsync(backup->file_descriptor) == -1))
+        backup->failed = true;
+    free(buffer);
+    atomic_store_explicit(&backup->finished, true, memory_order_release);
+    return NULL;
+}
+
+/* Called before a page changes while a backup runs. */
+void backup_save_page(backup *backup, uint64_t page_num, const void *page)
+{
+    if (page_num >= backup->snapshot_pages)
+        return;
+    pthread_mutex_lock(&backup->lock);
+    if (!backup_page_copied(backup, page_num) && backup->saved[page_num] == NULL)
+    {
+        backup->saved[page_num] = malloc(backup->page_size);
+        memcpy(backup->saved[page_num], page, backup->page_size);
+    }
+    pthread_mutex_unlock(&backup->lock);
+}
+
+/* Start copying the database to path in the background. An incremental
+   backup updates an earlier backup at path with the pages written since. */
+bool backup_start(table *table, const char *path, bool incremental)
+{
+    pager *pager = table->pager;
+    if (pager->backup != NULL && !atomic_load_explicit(&pager->backup->finished, memory_order_acquire))
+    {
+        printf("A backup is already running.\n");
+        return false;
+    }
+    backup_finish(pager);
+
+    int fd = open(path, O_RDWR | O_CREAT | (incremental ? 0 : O_TRUNC), S_IWUSR | S_IRUSR);
+    if (fd == -1)
+    {
+        printf("Unable to open backup file.\n");
+        return false;
+    }
+
+    uint64_t base_generation = 0;
+    if (incremental)
+    {
+        char header[PAGE_SIZE_MIN];
+        if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            memcmp(header + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE) != 0 ||
+            *header_version(header) != DB_FORMAT_VERSION || *header_page_size(header) != pager->page_size ||
+            *header_generation(header) > pager->generation)
+        {
+            printf("No earlier backup of this database at %s.\n", path);
+            close(fd);
+            return false;
+        }
+        base_generation = *header_generation(header);
+    }
+
+    /* checkpoint: from here on the file holds the snapshot until pages change */
+    pager_flush(pager);
+
+    backup *backup = malloc(sizeof(*backup));
+    backup->file_descriptor = fd;
+    backup->source_descriptor = pager->file_descriptor;
+    snprintf(backup->path, sizeof(backup->path), "%s", path);
+    backup->page_size = pager->page_size;
+    backup->snapshot_pages = pager->num_pages;
+    backup->snapshot_generation = pager->generation;
+    backup->base_generation = base_generation;
+    backup->incremental = incremental;
+    pthread_mutex_init(&backup->lock, NULL);
+    backup->copied = calloc((backup->snapshot_pages + 7) / 8, 1);
+    backup->saved = calloc(backup->snapshot_pages, sizeof(void *));
+    atomic_init(&backup->pages_scanned, 0);
+    atomic_init(&backup->pages_copied, 0);
+    atomic_init(&backup->finished, false);
+    backup->failed = false;
+    pager->backup = backup;
+
+    /* pages written after the snapshot belong to the next generation */
+    void *header = get_page(pager, 0);
+    pager_mark_dirty(pager, 0);
+    pthread_mutex_lock(&pager->lock); /* the background writer stamps it too */
+    pager->generation++;
+    pthread_mutex_unlock(&pager->lock);
+    *header_generation(header) = pager->generation;
+
+    if (pthread_create(&backup->thread, NULL, backup_worker, backup) != 0)
+    {
+        printf("Unable to start backup thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+/* wait for the last backup and release it */
+void backup_finish(pager *pager)
+{
+    backup *backup = pager->backup;
+    if (backup == NULL)
+        return;
+
+    pthread_join(backup->thread, NULL);
+    close(backup->file_descriptor);
+    for (uint64_t i = 0; i < backup->snapshot_pages; i++)
+        free(backup->saved[i]);
+    free(backup->saved);
+    free(backup->copied);
+    pthread_mutex_destroy(&backup->lock);
+    free(backup);
+    pager->backup = NULL;
+}
+
+/* --- File header helpers --- */
+uint32_t *header_version(void *page)
+{
+    return (uint32_t *)((char *)page + HEADER_VERSION_OFFSET);
+}
+
+uint32_t *header_page_size(void *page)
+{
+    return (uint32_t *)((char *)page + HEADER_PAGE_SIZE_OFFSET);
+}
+
+uint64_t *header_root_page_num(void *page)
+{
+    return (uint64_t *)((char *)page + HEADER_ROOT_PAGE_OFFSET);
+}
+
+uint64_t *header_generation(void *page)
+{
+    return (uint64_t *)((char *)page + HEADER_GENERATION_OFFSET);
+}
+
+uint32_t *header_shard_count(void *page)
+{
+    return (uint32_t *)((char *)page + HEADER_SHARD_COUNT_OFFSET);
+}
+
+uint32_t *header_shard_index(void *page)
+{
+    return (uint32_t *)((char *)page + HEADER_SHARD_INDEX_OFFSET);
+}
+
+uint64_t *header_dictionary_page_num(void *page)
+{
+    return (uint64_t *)((char *)page + HEADER_DICTIONARY_PAGE_OFFSET);
+}
+
+/* a power of two from PAGE_SIZE_MIN to PAGE_SIZE_MAX */
+bool page_size_valid(uint32_t page_size)
+{
+    return page_size >= PAGE_SIZE_MIN && page_size <= PAGE_SIZE_MAX && (page_size & (page_size - 1)) == 0;
+}
+
+void initialize_file_header(void *page, uint32_t page_size)
+{
+    memcpy((char *)page + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE);
+    *header_version(page) = DB_FORMAT_VERSION;
+    *header_page_size(page) = page_size;
+    *header_root_page_num(page) = 1;
+    *header_generation(page) = 1;
+    *header_dictionary_page_num(page) = 0;
+}
+
+uint64_t *node_generation(void *node)
+{
+    return (uint64_t *)((char *)node + NODE_GENERATION_OFFSET);
+}
+
+/* --- Leaf helpers --- */
+uint32_t *leaf_node_num_cells(void *node)
+{
+    return (uint32_t *)((char *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+uint64_t *leaf_node_next_leaf(void *node)
+{
+    return (uint64_t *)((char *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+void *leaf_node_cell(void *node, uint32_t cell_num)
+{
+    if (leaf_node_layout(node) == LEAF_LAYOUT_DICT)
+        return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_DICT_CELL_SIZE;
+    return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+uint64_t *leaf_node_key(void *node, uint32_t cell_num)
+{
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX)
+        return (uint64_t *)((char *)node + LEAF_PAX_KEYS_OFFSET) + cell_num;
+    return (uint64_t *)((char *)leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET);
+}
+
+void *leaf_node_value(void *node, uint32_t cell_num)
+{
+    return (char *)leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+leaflayout leaf_node_layout(void *node)
+{
+    return *((uint8_t *)node + LEAF_NODE_LAYOUT_OFFSET);
+}
+
+uint32_t leaf_node_max_cells(void *node)
+{
+    return *(uint16_t *)((char *)node + LEAF_NODE_MAX_CELLS_OFFSET);
+}
+
+char *leaf_node_username(void *node, uint32_t cell_num)
+{
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX)
+        return (char *)node + LEAF_PAX_USERNAMES_OFFSET(leaf_node_max_cells(node)) + cell_num * USERNAME_SIZE;
+    if (leaf_node_layout(node) == LEAF_LAYOUT_DICT)
+        return (char *)leaf_node_cell(node, cell_num) + LEAF_DICT_USERNAME_OFFSET;
+    return (char *)leaf_node_value(node, cell_num) + USERNAME_OFFSET;
+}
+
+/* On a dictionary leaf only the part before the domain, or the whole email
+   if its code is 0. */
+char *leaf_node_email(void *node, uint32_t cell_num)
+{
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX)
+        return (char *)node + LEAF_PAX_EMAILS_OFFSET(leaf_node_max_cells(node)) + cell_num * EMAIL_SIZE;
+    if (leaf_node_layout(node) == LEAF_LAYOUT_DICT)
+        return (char *)leaf_node_cell(node, cell_num) + LEAF_DICT_LOCAL_OFFSET;
+    return (char *)leaf_node_value(node, cell_num) + EMAIL_OFFSET;
+}
+
+/* dictionary leaves only */
+uint16_t *leaf_node_email_code(void *node, uint32_t cell_num)
+{
+    return (uint16_t *)((char *)leaf_node_cell(node, cell_num) + LEAF_DICT_CODE_OFFSET);
+}
+
+/* The key is set separately, as for row leaves. A dictionary leaf needs the
+   email's domain in the dictionary already, see table_encode_rows. */
+void leaf_node_write_row(emaildictionary *dictionary, void *node, uint32_t cell_num, row *source)
+{
+    leaflayout layout = leaf_node_layout(node);
+    if (layout == LEAF_LAYOUT_ROW)
+    {
+        serialize_row(source, leaf_node_value(node, cell_num));
+        return;
+    }
+    strncpy(leaf_node_username(node, cell_num), source->username, USERNAME_SIZE);
+    if (layout == LEAF_LAYOUT_PAX)
+    {
+        strncpy(leaf_node_email(node, cell_num), source->email, EMAIL_SIZE);
+        return;
+    }
+    uint16_t code;
+    size_t inline_length;
+    if (!email_encode(dictionary, source->email, false, &code, &inline_length))
+    {
+        printf("Email %s was not encoded before it was written.\n", source->email);
+        exit(EXIT_FAILURE);
+    }
+    *leaf_node_email_code(node, cell_num) = code;
+    char *local = leaf_node_email(node, cell_num);
+    memcpy(local, source->email, inline_length);
+    memset(local + inline_length, 0, LEAF_DICT_LOCAL_SIZE - inline_length);
+}
+
+/* both nodes must have the same layout */
+void leaf_node_copy_cell(void *destination_node, uint32_t destination_cell, void *source_node, uint32_t source_cell)
+{
+    leaflayout layout = leaf_node_layout(source_node);
+    if (layout != LEAF_LAYOUT_PAX)
+    {
+        memcpy(leaf_node_cell(destination_node, destination_cell), leaf_node_cell(source_node, source_cell),
+               layout == LEAF_LAYOUT_DICT ? LEAF_DICT_CELL_SIZE : LEAF_NODE_CELL_SIZE);
+        return;
+    }
+    *leaf_node_key(destination_node, destination_cell) = *leaf_node_key(source_node, source_cell);
+    memcpy(leaf_node_username(destination_node, destination_cell), leaf_node_username(source_node, source_cell),
+           USERNAME_SIZE);
+    memcpy(leaf_node_email(destination_node, destination_cell), leaf_node_email(source_node, source_cell),
+           EMAIL_SIZE);
+}
+
+/* Points into the page, and into the dictionary for a domain; no copy. */
+void leaf_node_row_view(emaildictionary *dictionary, void *node, uint32_t cell_num, rowview *view)
+{
+    view->id = *leaf_node_key(node, cell_num);
+    view->username = leaf_node_username(node, cell_num);
+    view->email = leaf_node_email(node, cell_num);
+    view->email_domain = NULL;
+    if (leaf_node_layout(node) == LEAF_LAYOUT_DICT && *leaf_node_email_code(node, cell_num) != 0)
+        view->email_domain = email_dictionary_domain(dictionary, *leaf_node_email_code(node, cell_num));
+}
+
+void initialize_leaf_node(void *node, leaflayout layout, uint32_t page_size)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *((uint8_t *)node + LEAF_NODE_LAYOUT_OFFSET) = layout;
+    *(uint16_t *)((char *)node + LEAF_NODE_MAX_CELLS_OFFSET) =
+        layout == LEAF_LAYOUT_DICT ? LEAF_DICT_MAX_CELLS(page_size) : LEAF_NODE_MAX_CELLS(page_size);
+    *leaf_node_next_leaf(node) = 0;
+}
+
+/* --- Email domain dictionary --- */
+uint32_t email_domain_hash(const char *domain, size_t length)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)domain[i]) * 16777619u;
+    return hash;
+}
+
+/* code must be one the dictionary has handed out */
+const char *email_dictionary_domain(emaildictionary *dictionary, uint16_t code)
+{
+    return dictionary->chunks[(code - 1) / EMAIL_DOMAIN_CHUNK][(code - 1) % EMAIL_DOMAIN_CHUNK];
+}
+
+/* The code of a domain, or 0 if it has none. The caller holds the lock. */
+uint16_t email_dictionary_find(emaildictionary *dictionary, const char *domain, size_t length)
+{
+    uint32_t slot = email_domain_hash(domain, length) & dictionary->slot_mask;
+    while (dictionary->slots[slot] != 0)
+    {
+        const char *candidate = email_dictionary_domain(dictionary, dictionary->slots[slot]);
+        if (strncmp(candidate, domain, length) == 0 && candidate[length] == '\0')
+            return dictionary->slots[slot];
+        slot = (slot + 1) & dictionary->slot_mask;
+    }
+    return 0;
+}
+
+void email_dictionary_place(emaildictionary *dictionary, uint16_t code)
+{
+    const char *domain = email_dictionary_domain(dictionary, code);
+    uint32_t slot = email_domain_hash(domain, strlen(domain)) & dictionary->slot_mask;
+    while (dictionary->slots[slot] != 0)
+        slot = (slot + 1) & dictionary->slot_mask;
+    dictionary->slots[slot] = code;
+}
+
+/* Give a domain the next code, in memory only. The caller holds the lock. */
+uint16_t email_dictionary_remember(emaildictionary *dictionary, const char *domain, size_t length)
+{
+    uint32_t count = atomic_load_explicit(&dictionary->count, memory_order_relaxed);
+    if ((count + 1) * 2 > dictionary->slot_mask + 1)
+    {
+        /* keep the slots at most half full */
+        uint32_t size = (dictionary->slot_mask + 1) * 2;
+        free(dictionary->slots);
+        dictionary->slots = calloc(size, sizeof(uint16_t));
+        dictionary->slot_mask = size - 1;
+        for (uint32_t code = 1; code <= count; code++)
+            email_dictionary_place(dictionary, (uint16_t)code);
+    }
+    uint32_t chunk = count / EMAIL_DOMAIN_CHUNK;
+    if (dictionary->chunks[chunk] == NULL)
+        dictionary->chunks[chunk] = malloc(EMAIL_DOMAIN_CHUNK * sizeof(char *));
+    dictionary->chunks[chunk][count % EMAIL_DOMAIN_CHUNK] = strndup(domain, length);
+    uint16_t code = (uint16_t)(count + 1);
+    email_dictionary_place(dictionary, code);
+    /* readers decode codes up to count without the lock */
+    atomic_store_explicit(&dictionary->count, count + 1, memory_order_release);
+    return code;
+}
+
+/* Append a domain to the last dictionary page, starting a new one when it is
+   full. The caller holds the lock. */
+void email_dictionary_store(emaildictionary *dictionary, uint16_t code)
+{
+    pager *pager = dictionary->pager;
+    const char *domain = email_dictionary_domain(dictionary, code);
+    size_t length = strlen(domain);
+    frame *page = dictionary->last_page_num != 0 ? pager_latch(pager, dictionary->last_page_num, true) : NULL;
+    uint32_t used = page != NULL ? *(uint32_t *)((char *)page->data + DICTIONARY_USED_OFFSET) : 0;
+    if (page == NULL || DICTIONARY_HEADER_SIZE + used + 1 + length > pager->page_size)
+    {
+        uint64_t page_num = get_unused_page_num(pager);
+        frame *new_page = pager_latch(pager, page_num, true);
+        pager_mark_dirty(pager, page_num);
+        memset(new_page->data, 0, pager->page_size);
+        if (page != NULL)
+        {
+            pager_mark_dirty(pager, dictionary->last_page_num);
+            *(uint64_t *)((char *)page->data + DICTIONARY_NEXT_PAGE_OFFSET) = page_num;
+            pager_unlatch(page);
+        }
+        else
+        {
+            frame *header = pager_latch(pager, 0, true);
+            pager_mark_dirty(pager, 0);
+            *header_dictionary_page_num(header->data) = page_num;
+            pager_unlatch(header);
+        }
+        page = new_page;
+        dictionary->last_page_num = page_num;
+        used = 0;
+    }
+    pager_mark_dirty(pager, dictionary->last_page_num);
+    char *entry = (char *)page->data + DICTIONARY_HEADER_SIZE + used;
+    entry[0] = (char)length;
+    memcpy(entry + 1, domain, length);
+    *(uint32_t *)((char *)page->data + DICTIONARY_USED_OFFSET) = used + 1 + (uint32_t)length;
+    pager_unlatch(page);
+}
+
+/* Read the whole dictionary of a tree into memory. */
+emaildictionary *email_dictionary_open(pager *pager, uint64_t first_page_num)
+{
+    emaildictionary *dictionary = calloc(1, sizeof(*dictionary));
+    pthread_mutex_init(&dictionary->lock, NULL);
+    dictionary->slot_mask = 63;
+    dictionary->slots = calloc(dictionary->slot_mask + 1, sizeof(uint16_t));
+    dictionary->pager = pager;
+    for (uint64_t page_num = first_page_num; page_num != 0;)
+    {
+        char *page = get_page(pager, page_num);
+        uint32_t used = *(uint32_t *)(page + DICTIONARY_USED_OFFSET);
+        char *entries = page + DICTIONARY_HEADER_SIZE;
+        for (uint32_t offset = 0; offset < used; offset += 1 + (uint8_t)entries[offset])
+            email_dictionary_remember(dictionary, entries + offset + 1, (uint8_t)entries[offset]);
+        dictionary->last_page_num = page_num;
+        page_num = *(uint64_t *)(page + DICTIONARY_NEXT_PAGE_OFFSET);
+        pager_unpin_all(pager);
+    }
+    return dictionary;
+}
+
+void email_dictionary_close(emaildictionary *dictionary)
+{
+    uint32_t count = atomic_load(&dictionary->count);
+    for (uint32_t code = 1; code <= count; code++)
+        free((char *)email_dictionary_domain(dictionary, (uint16_t)code));
+    for (uint32_t i = 0; i < sizeof(dictionary->chunks) / sizeof(dictionary->chunks[0]); i++)
+        free(dictionary->chunks[i]);
+    free(dictionary->slots);
+    pthread_mutex_destroy(&dictionary->lock);
+    free(dictionary);
+}
+
+/* Store every domain again in a new file, with the same codes. */
+void email_dictionary_rewrite(emaildictionary *dictionary, pager *pager)
+{
+    pthread_mutex_lock(&dictionary->lock);
+    dictionary->pager = pager;
+    dictionary->last_page_num = 0;
+    uint32_t count = atomic_load(&dictionary->count);
+    for (uint32_t code = 1; code <= count; code++)
+        email_dictionary_store(dictionary, (uint16_t)code);
+    pthread_mutex_unlock(&dictionary->lock);
+}
+
+/* Split an email for a dictionary leaf: the domain after the last '@' becomes
+   *code and the part before it stays inline. Code 0 keeps the whole email
+   inline. With add, a new domain is given a code and stored. Returns false if
+   the email is too long to keep inline. */
+bool email_encode(emaildictionary *dictionary, const char *email, bool add, uint16_t *code, size_t *inline_length)
+{
+    const char *at = strrchr(email, '@');
+    *code = 0;
+    if (at != NULL && at > email && at[1] != '\0' && (size_t)(at - email) <= EMAIL_LOCAL_SIZE)
+    {
+        size_t length = strlen(at + 1);
+        pthread_mutex_lock(&dictionary->lock);
+        *code = email_dictionary_find(dictionary, at + 1, length);
+        if (*code == 0 && add && atomic_load(&dictionary->count) < EMAIL_DOMAINS_MAX)
+        {
+            *code = email_dictionary_remember(dictionary, at + 1, length);
+            email_dictionary_store(dictionary, *code);
+        }
+        pthread_mutex_unlock(&dictionary->lock);
+        if (*code != 0)
+        {
+            *inline_length = (size_t)(at - email);
+            return true;
+        }
+    }
+    *inline_length = strlen(email);
+    return *inline_length <= EMAIL_LOCAL_SIZE;
+}
+
+/* Whether email_encode with add would accept the email, without adding
+   anything: its domain has a code or can still get one, or it fits inline. */
+bool email_storable(emaildictionary *dictionary, const char *email)
+{
+    const char *at = strrchr(email, '@');
+    if (at != NULL && at > email && at[1] != '\0' && (size_t)(at - email) <= EMAIL_LOCAL_SIZE)
+    {
+        pthread_mutex_lock(&dictionary->lock);
+        bool codable = email_dictionary_find(dictionary, at + 1, strlen(at + 1)) != 0 ||
+                       atomic_load(&dictionary->count) < EMAIL_DOMAINS_MAX;
+        pthread_mutex_unlock(&dictionary->lock);
+        if (codable)
+            return true;
+    }
+    return strlen(email) <= EMAIL_LOCAL_SIZE;
+}
+
+/* Checked before anything else about an insert, so a rejected insert leaves
+   the dictionary alone. */
+bool table_rows_storable(table *table, row *rows, uint32_t count)
+{
+    if (table->dictionary == NULL)
+        return true;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!email_storable(table->dictionary, rows[i].email))
+            return false;
+    }
+    return true;
+}
+
+/* Add the domains of rows about to be inserted to the dictionary, once the
+   insert is sure to go ahead and before any row is written. Returns false
+   only if the codes ran out since table_rows_storable. */
+bool table_encode_rows(table *table, row *rows, uint32_t count)
+{
+    if (table->dictionary == NULL)
+        return true;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t code;
+        size_t inline_length;
+        if (!email_encode(table->dictionary, rows[i].email, true, &code, &inline_length))
+            return false;
+    }
+    return true;
+}
+
+/* --- Node type and root flag helpers --- */
+nodetype get_node_type(void *node)
+{
+    uint8_t value = *((uint8_t *)((char *)node + NODE_TYPE_OFFSET));
+    return (nodetype)value;
+}
+
+void set_node_type(void *node, nodetype type)
+{
+    uint8_t value = (uint8_t)type;
+    *((uint8_t *)((char *)node + NODE_TYPE_OFFSET)) = value;
+}
+
+bool is_node_root(void *node)
+{
+    uint8_t value = *((uint8_t *)((char *)node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+void set_node_root(void *node, bool is_root)
+{
+    uint8_t value = is_root ? 1 : 0;
+    *((uint8_t *)((char *)node + IS_ROOT_OFFSET)) = value;
+}
+
+/* --- Internal node helpers --- */
+uint32_t *internal_node_num_keys(void *node)
+{
+    return (uint32_t *)((char *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint64_t *internal_node_right_child(void *node)
+{
+    return (uint64_t *)((char *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint64_t *internal_node_cell(void *node, uint32_t cell_num)
+{
+    return (uint64_t *)((char *)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+}
+
+uint64_t *internal_node_child(void *node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys)
+    {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    }
+    else if (child_num == num_keys)
+    {
+        uint64_t *right_child = internal_node_right_child(node);
+        if (*right_child == INVALID_PAGE_NUM)
+        {
+            printf("Tried to access right child of node, but was invalid page\n");
+            exit(EXIT_FAILURE);
+        }
+        return right_child;
+    }
+    else
+    {
+        uint64_t *child = internal_node_cell(node, child_num);
+        if (*child == INVALID_PAGE_NUM)
+        {
+            printf("Tried to access child %d of node, but was invalid page\n", child_num);
+            exit(EXIT_FAILURE);
+        }
+        return child;
+    }
+}
+
+/* pointer arithmetic: add bytes to pointer (work with char*) */
+uint64_t *internal_node_key(void *node, uint32_t key_num)
+{
+    return (uint64_t *)((char *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+}
+
+void initialize_internal_node(void *node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+/* get_node_max_key walking down right children until leaf */
+uint64_t get_node_max_key(pager *pager, void *node)
+{
+    if (get_node_type(node) == NODE_LEAF)
+    {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (num_cells == 0)
+            return 0;
+        return *leaf_node_key(node, num_cells - 1);
+    }
+    else
+    {
+        uint64_t right_child_page = *internal_node_right_child(node);
+        void *right_child = get_page(pager, right_child_page);
+        return get_node_max_key(pager, right_child);
+    }
+}
+
+/* --- leaf split/insert --- */
+
+void leaf_node_split_and_insert(cursor *cursor, uint64_t key, row *value)
+{
+    pager *pager = cursor->table->pager;
+    void *old_node = get_page(pager, cursor->page_num);
+    double started = pager->trace != NULL ? clock_seconds() : 0;
+
+    /* new pages are latched so no other writer's unpin can evict them early */
+    uint64_t new_page_num = get_unused_page_num(pager);
+    frame *new_frame = pager_latch(pager, new_page_num, true);
+    void *new_node = new_frame->data;
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_leaf_node(new_node, leaf_node_layout(old_node), pager->page_size);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    uint32_t max_cells = leaf_node_max_cells(old_node);
+    uint32_t right_split_count = (max_cells + 1) / 2;
+    uint32_t left_split_count = (max_cells + 1) - right_split_count;
+    for (int32_t i = (int32_t)max_cells; i >= 0; i--)
+    {
+        void *destination_node;
+        if ((uint32_t)i >= left_split_count)
+        {
+            destination_node = new_node;
+        }
+        else
+        {
+            destination_node = old_node;
+        }
+
+        uint32_t index_within_node = (uint32_t)i;
+        if ((uint32_t)i >= left_split_count)
+        {
+            index_within_node = (uint32_t)i - left_split_count;
+        }
+
+        if ((uint32_t)i == cursor->cell_num)
+        {
+            *leaf_node_key(destination_node, index_within_node) = key;
+            leaf_node_write_row(cursor->table->dictionary, destination_node, index_within_node, value);
+        }
+        else if ((uint32_t)i > cursor->cell_num)
+        {
+            leaf_node_copy_cell(destination_node, index_within_node, old_node, (uint32_t)i - 1);
+        }
+        else
+        {
+            leaf_node_copy_cell(destination_node, index_within_node, old_node, (uint32_t)i);
+        }
+    }
+
+    *leaf_node_num_cells(old_node) = left_split_count;
+    *leaf_node_num_cells(new_node) = right_split_count;
+
+    if (is_node_root(old_node))
+    {
+        create_new_root(cursor->table, *leaf_node_key(old_node, left_split_count - 1), new_page_num);
+    }
+    else
+    {
+        uint64_t left_max = *leaf_node_key(old_node, left_split_count - 1);
+        internal_node_insert(cursor, cursor->depth - 1, left_max, new_page_num);
+    }
+    pager_unlatch(new_frame);
+    if (pager->trace != NULL)
+    {
+        pager->trace->leaf_splits++;
+        pager->trace->split_seconds += clock_seconds() - started;
+    }
+}
+
+/* --- Cursor / find helpers --- */
+/* Cursors are owned by the caller, usually on its stack. */
+void table_start(table *table, cursor *cursor)
+{
+    table_find(table, 0, cursor);
+
+    void *node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    cursor->end_of_table = (num_cells == 0);
+}
+
+/* forward-declare internal_node_find_child prior to using in other functions */
+uint32_t internal_node_find_child(void *node, uint64_t key)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys; /* there is one more child than key */
+
+    while (min_index != max_index)
+    {
+        uint32_t index = (min_index + max_index) / 2;
+        uint64_t key_to_right = *internal_node_key(node, index);
+        if (key_to_right >= key)
+        {
+            max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+    return min_index;
+}
+
+/* table_find: descend from the root, remembering the path for splits */
+void table_find(table *table, uint64_t key, cursor *cursor)
+{
+    uint32_t depth = 0;
+    double started = table->pager->trace != NULL ? clock_seconds() : 0;
+
+    uint64_t page_num = table->root_page_num;
+    void *node = get_page(table->pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        if (depth >= TABLE_MAX_DEPTH)
+        {
+            printf("Tree deeper than %d levels\n", TABLE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_index = internal_node_find_child(node, key);
+        cursor->path[depth] = page_num;
+        cursor->path_child[depth] = child_index;
+        depth++;
+
+        page_num = *internal_node_child(node, child_index);
+        node = get_page(table->pager, page_num);
+    }
+
+    leaf_node_find(table, page_num, key, cursor);
+    cursor->depth = depth;
+    if (table->pager->trace != NULL)
+        trace_descent(table->pager->trace, cursor, started);
+}
+
+/* positions the cursor only; the path fields are left to table_find */
+void leaf_node_find(table *table, uint64_t page_num, uint64_t key, cursor *cursor)
+{
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->end_of_table = false;
+    cursor->readahead_window = 0;
+    cursor->backward = false;
+    cursor->depth = 0;
+
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = num_cells;
+    while (one_past_max_index != min_index)
+    {
+        uint32_t index = (min_index + one_past_max_index) / 2;
+        uint64_t key_at_index = *leaf_node_key(node, index);
+        if (key == key_at_index)
+        {
+            cursor->cell_num = index;
+            return;
+        }
+        if (key < key_at_index)
+        {
+            one_past_max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+
+    cursor->cell_num = min_index;
+}
+
+void *cursor_value(cursor *c)
+{
+    return leaf_node_value(get_page(c->table->pager, c->page_num), c->cell_num);
+}
+
+void cursor_advance(cursor *cursor)
+{
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        uint64_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            path_next_leaf(cursor->table->pager, cursor->path, cursor->path_child, cursor->depth);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+            if (cursor->table->pager->trace != NULL)
+                cursor->table->pager->trace->leaves_walked++;
+            cursor_readahead(cursor);
+        }
+    }
+}
+
+/* Step a root-to-leaf path one leaf to the right, touching only internal
+   nodes. Returns the new leaf's page number, or 0 past the last leaf. */
+uint64_t path_next_leaf(pager *pager, uint64_t *path, uint32_t *path_child, uint32_t depth)
+{
+    int32_t level = (int32_t)depth - 1;
+    while (level >= 0 && path_child[level] >= *internal_node_num_keys(get_page(pager, path[level])))
+        level--;
+    if (level < 0)
+        return 0;
+
+    path_child[level]++;
+    for (; level + 1 < (int32_t)depth; level++)
+    {
+        path[level + 1] = *internal_node_child(get_page(pager, path[level]), path_child[level]);
+        path_child[level + 1] = 0;
+    }
+    return *internal_node_child(get_page(pager, path[depth - 1]), path_child[depth - 1]);
+}
+
+/* The same one leaf to the left, or 0 before the first leaf. */
+uint64_t path_prev_leaf(pager *pager, uint64_t *path, uint32_t *path_child, uint32_t depth)
+{
+    int32_t level = (int32_t)depth - 1;
+    while (level >= 0 && path_child[level] == 0)
+        level--;
+    if (level < 0)
+        return 0;
+
+    path_child[level]--;
+    for (; level + 1 < (int32_t)depth; level++)
+    {
+        path[level + 1] = *internal_node_child(get_page(pager, path[level]), path_child[level]);
+        path_child[level + 1] = *internal_node_num_keys(get_page(pager, path[level + 1]));
+    }
+    return *internal_node_child(get_page(pager, path[depth - 1]), path_child[depth - 1]);
+}
+
+/* Step back one cell. Leaves only link to the right, so the previous leaf is
+   found through the path instead, which touches only cached internal nodes. */
+void cursor_retreat(cursor *cursor)
+{
+    pager *pager = cursor->table->pager;
+    while (cursor->cell_num == 0)
+    {
+        uint64_t prev_page_num = path_prev_leaf(pager, cursor->path, cursor->path_child, cursor->depth);
+        if (prev_page_num == 0)
+        {
+            cursor->end_of_table = true;
+            return;
+        }
+        cursor->page_num = prev_page_num;
+        cursor->cell_num = *leaf_node_num_cells(get_page(pager, prev_page_num));
+        if (pager->trace != NULL)
+            pager->trace->leaves_walked++;
+        cursor_readahead(cursor);
+    }
+    cursor->cell_num--;
+}
+
+/* Prefetch the leaves after the cursor's current one. The window doubles on
+   every leaf the scan walks into, up to READAHEAD_MAX_WINDOW. */
+void cursor_readahead(cursor *cursor)
+{
+    if (cursor->readahead_window == 0)
+        return;
+
+    pager *pager = cursor->table->pager;
+    uint64_t page_nums[READAHEAD_MAX_WINDOW];
+    uint32_t count = 0;
+
+    /* leaves ahead are found through the internal nodes on the cursor's path */
+    uint64_t path[TABLE_MAX_DEPTH];
+    uint32_t path_child[TABLE_MAX_DEPTH];
+    memcpy(path, cursor->path, cursor->depth * sizeof(uint64_t));
+    memcpy(path_child, cursor->path_child, cursor->depth * sizeof(uint32_t));
+    while (count < cursor->readahead_window)
+    {
+        uint64_t page_num = cursor->backward ? path_prev_leaf(pager, path, path_child, cursor->depth)
+                                             : path_next_leaf(pager, path, path_child, cursor->depth);
+        if (page_num == 0)
+            break;
+        page_nums[count++] = page_num;
+    }
+    if (count == 0)
+        return;
+
+    readahead_pages(pager, page_nums, count);
+
+    if (cursor->readahead_window < READAHEAD_MAX_WINDOW)
+        cursor->readahead_window *= 2;
+}
+
+/* --- Scan operator: predicate pushdown over row views --- */
+bool string_predicate_matches(stringpredicate *predicate, const char *field)
+{
+    switch (predicate->type)
+    {
+    case STRING_MATCH_EQUAL:
+        /* compare the terminator too so "bob" does not match "bobby" */
+        return memcmp(field, predicate->value, predicate->length + 1) == 0;
+    case STRING_MATCH_PREFIX:
+        return memcmp(field, predicate->value, predicate->length) == 0;
+    case STRING_MATCH_SUFFIX:
+    {
+        size_t length = strlen(field);
+        return length >= predicate->length &&
+               memcmp(field + length - predicate->length, predicate->value, predicate->length) == 0;
+    }
+    default:
+        return true;
+    }
+}
+
+void scan_open(scanoperator *scan, table *table, scanpredicate *predicate)
+{
+    scan->predicate = predicate;
+    scan->filtered_page_num = INVALID_PAGE_NUM;
+    scan->trace = table->pager->trace;
+    scan->email_by_code = false;
+    if (table->dictionary != NULL)
+    {
+        /* email = "x@domain" and email like "%@domain" name a whole domain */
+        stringpredicate *email = &predicate->email;
+        const char *domain = NULL;
+        if (email->type == STRING_MATCH_SUFFIX && email->value[0] == '@' && strchr(email->value + 1, '@') == NULL)
+        {
+            domain = email->value + 1;
+        }
+        else if (email->type == STRING_MATCH_EQUAL)
+        {
+            const char *at = strrchr(email->value, '@');
+            if (at != NULL && at > email->value && (size_t)(at - email->value) <= EMAIL_LOCAL_SIZE)
+            {
+                domain = at + 1;
+                scan->email_local_length = (size_t)(at - email->value);
+            }
+        }
+        if (domain != NULL && domain[0] != '\0')
+        {
+            scan->email_by_code = true;
+            pthread_mutex_lock(&table->dictionary->lock);
+            scan->email_domain_code = email_dictionary_find(table->dictionary, domain, strlen(domain));
+            pthread_mutex_unlock(&table->dictionary->lock);
+        }
+    }
+    cursor *cursor = &scan->cursor;
+    if (predicate->descending)
+    {
+        /* seek to the first id at or past id_max and step back unless it is id_max */
+        table_find(table, predicate->id_max, cursor);
+        cursor->readahead_window = 1;
+        cursor->backward = true;
+        void *node = get_page(table->pager, cursor->page_num);
+        cursor->end_of_table = false;
+        if (cursor->cell_num >= *leaf_node_num_cells(node) || *leaf_node_key(node, cursor->cell_num) != predicate->id_max)
+            cursor_retreat(cursor);
+        if (!cursor->end_of_table)
+            cursor_readahead(cursor);
+        return;
+    }
+    table_find(table, predicate->id_min, cursor);
+    cursor->readahead_window = 1;
+
+    /* the seek can land one past the last cell of a leaf */
+    void *node = get_page(table->pager, cursor->page_num);
+    cursor->end_of_table = false;
+    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        uint64_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            path_next_leaf(table->pager, cursor->path, cursor->path_child, cursor->depth);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+            if (scan->trace != NULL)
+                scan->trace->leaves_walked++;
+        }
+    }
+    if (!cursor->end_of_table)
+        cursor_readahead(cursor);
+}
+
+/* An email predicate on a dictionary leaf. A whole domain is compared by
+   code and a prefix without an '@' against the inline part; anything else
+   decodes the email first. */
+bool leaf_node_email_matches(scanoperator *scan, void *node, uint32_t cell_num)
+{
+    stringpredicate *predicate = &scan->predicate->email;
+    uint16_t code = *leaf_node_email_code(node, cell_num);
+    const char *local = leaf_node_email(node, cell_num);
+    if (code != 0 && scan->email_by_code)
+    {
+        if (code != scan->email_domain_code)
+            return false;
+        size_t length = scan->email_local_length;
+        return predicate->type == STRING_MATCH_SUFFIX ||
+               (strncmp(local, predicate->value, length) == 0 && local[length] == '\0');
+    }
+    if (predicate->type == STRING_MATCH_PREFIX && (code == 0 || memchr(predicate->value, '@', predicate->length) == NULL))
+        return strncmp(local, predicate->value, predicate->length) == 0;
+
+    char email[EMAIL_SIZE];
+    if (code == 0)
+        snprintf(email, EMAIL_SIZE, "%s", local);
+    else
+        snprintf(email, EMAIL_SIZE, "%s@%s", local, email_dictionary_domain(scan->cursor.table->dictionary, code));
+    return string_predicate_matches(predicate, email);
+}
+
+/* One pass per predicate column over the whole leaf, so on PAX leaves each
+   pass reads a single dense minipage; other columns are read only for matches. */
+void leaf_node_filter(scanoperator *scan, void *node)
+{
+    scanpredicate *predicate = scan->predicate;
+    bool *matches = scan->matches;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++)
+        matches[i] = true;
+    if (predicate->username.type != STRING_MATCH_ANY)
+    {
+        for (uint32_t i = 0; i < num_cells; i++)
+            matches[i] = matches[i] && string_predicate_matches(&predicate->username, leaf_node_username(node, i));
+    }
+    if (predicate->email.type != STRING_MATCH_ANY && leaf_node_layout(node) == LEAF_LAYOUT_DICT)
+    {
+        for (uint32_t i = 0; i < num_cells; i++)
+            matches[i] = matches[i] && leaf_node_email_matches(scan, node, i);
+    }
+    else if (predicate->email.type != STRING_MATCH_ANY)
+    {
+        for (uint32_t i = 0; i < num_cells; i++)
+            matches[i] = matches[i] && string_predicate_matches(&predicate->email, leaf_node_email(node, i));
+    }
+}
+
+/* Returns the next matching row with only the projected columns copied out. */
+bool scan_next(scanoperator *scan, row *destination)
+{
+    cursor *c = &scan->cursor;
+    scanpredicate *predicate = scan->predicate;
+
+    while (!c->end_of_table)
+    {
+        /* the leaf stays pinned until the cursor leaves it */
+        if (scan->filtered_page_num != c->page_num)
+            scan->node = get_page(c->table->pager, c->page_num);
+        void *node = scan->node;
+        uint64_t key = *leaf_node_key(node, c->cell_num);
+        if (predicate->descending ? key < predicate->id_min : key > predicate->id_max)
+        {
+            c->end_of_table = true;
+            break;
+        }
+
+        if (scan->filtered_page_num != c->page_num)
+        {
+            leaf_node_filter(scan, node);
+            scan->filtered_page_num = c->page_num;
+        }
+        bool matches = scan->matches[c->cell_num];
+        if (scan->trace != NULL)
+            scan->trace->rows_examined++;
+        if (matches)
+        {
+            rowview view;
+            leaf_node_row_view(c->table->dictionary, node, c->cell_num, &view);
+            materialize_row(&view, predicate->columns, destination);
+        }
+
+        /* once the cursor leaves a leaf, scanned pages may be evicted */
+        if (predicate->descending ? c->cell_num > 0 : c->cell_num + 1 < *leaf_node_num_cells(node))
+        {
+            if (predicate->descending)
+                c->cell_num--;
+            else
+                c->cell_num++;
+        }
+        else
+        {
+            uint64_t page_num = c->page_num;
+            if (predicate->descending)
+                cursor_retreat(c);
+            else
+                cursor_advance(c);
+            if (c->page_num != page_num)
+                pager_unpin_all(c->table->pager);
+        }
+
+        if (matches)
+            return true;
+    }
+    return false;
+}
+
+void scan_close(scanoperator *scan)
+{
+    scan->cursor.end_of_table = true;
+}
+
+/* --- Table open / root init --- */
+
+/* Open one tree. A new file records options->num_shards and shard_index;
+   *num_shards gets the count the file was created with. */
+table *table_open(const char *filename, const dboptions *options, uint32_t shard_index, uint32_t *num_shards)
+{
+    pager *pager = pager_open(filename, options);
+    table *table = malloc(sizeof(*table));
+    table->pager = pager;
+    table->filename = strdup(filename);
+    table->options = *options;
+    table->vacuum = NULL;
+    table->num_shards = 0;
+    table->shards = NULL;
+    table->row_cache = NULL;
+    table->dictionary = NULL;
+
+    /* another process may be creating the file at the same time */
+    if (pager->shared != NULL)
+        pager_shared_begin(pager, true, INVALID_PAGE_NUM);
+    if (pager->num_pages == 0)
+    {
+        /* new database: header page, then an empty root leaf */
+        void *header = get_page(pager, 0);
+        pager_mark_dirty(pager, 0);
+        initialize_file_header(header, pager->page_size);
+        *header_shard_count(header) = options->num_shards;
+        *header_shard_index(header) = shard_index;
+
+        void *root_node = get_page(pager, 1);
+        pager_mark_dirty(pager, 1);
+        initialize_leaf_node(root_node, options->leaf_layout, pager->page_size);
+        set_node_root(root_node, true);
+    }
+
+    void *header = get_page(pager, 0);
+    if (memcmp((char *)header + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE) != 0 ||
+        *header_version(header) != DB_FORMAT_VERSION)
+    {
+        printf("Unsupported database file format.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (*header_shard_index(header) != shard_index)
+    {
+        printf("%s is shard %u, expected shard %u.\n", filename, *header_shard_index(header), shard_index);
+        exit(EXIT_FAILURE);
+    }
+    table->root_page_num = *header_root_page_num(header);
+    pager->generation = *header_generation(header);
+    *num_shards = *header_shard_count(header);
+    uint64_t dictionary_page_num = *header_dictionary_page_num(header);
+
+    /* every leaf has the layout of the first one */
+    cursor cursor;
+    table_find(table, 0, &cursor);
+    if (leaf_node_layout(get_page(pager, cursor.page_num)) == LEAF_LAYOUT_DICT)
+        table->dictionary = email_dictionary_open(pager, dictionary_page_num);
+    if (options->row_cache_rows > 0)
+    {
+        /* the shards split the rows between them */
+        uint32_t capacity = options->row_cache_rows / (*num_shards > 1 ? *num_shards : 1);
+        table->row_cache = rowcache_open(capacity > 0 ? capacity : 1);
+    }
+    if (pager->shared != NULL)
+        pager_shared_end(pager);
+
+    return table;
+}
+
+/* --- create_new_root: move the old root into a new left child --- */
+/* left_max separates the old root's keys from the right child's; taken from
+   the caller because a batch insert may not have linked every leaf yet */
+void create_new_root(table *table, uint64_t left_max, uint64_t right_child_page_num)
+{
+    pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    uint64_t left_child_page_num = get_unused_page_num(pager);
+    frame *left_child_frame = pager_latch(pager, left_child_page_num, true);
+    void *left_child = left_child_frame->data;
+    pager_mark_dirty(pager, table->root_page_num);
+    pager_mark_dirty(pager, left_child_page_num);
+
+    memcpy(left_child, root, pager->page_size);
+    set_node_root(left_child, false);
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    *internal_node_key(root, 0) = left_max;
+    *internal_node_right_child(root) = right_child_page_num;
+    pager_unlatch(left_child_frame);
+    if (pager->trace != NULL)
+        pager->trace->new_roots++;
+}
+
+/* --- internal_node_insert: the child at path[level] was split in two --- */
+/* The left half kept its page and now ends at left_max; the right half lives in
+   new_child_page_num and inherits the old key, so only this node changes. */
+void internal_node_insert(cursor *cursor, uint32_t level, uint64_t left_max, uint64_t new_child_page_num)
+{
+    pager *pager = cursor->table->pager;
+    uint64_t parent_page_num = cursor->path[level];
+    uint32_t index = cursor->path_child[level];
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+
+    if (num_keys >= INTERNAL_NODE_MAX_CELLS)
+    {
+        internal_node_split_and_insert(cursor, level, left_max, new_child_page_num);
+        return;
+    }
+
+    pager_mark_dirty(pager, parent_page_num);
+    *internal_node_num_keys(parent) = num_keys + 1;
+
+    if (index == num_keys)
+    {
+        /* split the right child: its left half gets a key, the new page becomes the right child */
+        *internal_node_cell(parent, num_keys) = *internal_node_right_child(parent);
+        *internal_node_key(parent, num_keys) = left_max;
+        *internal_node_right_child(parent) = new_child_page_num;
+        return;
+    }
+
+    for (uint32_t i = num_keys; i > index + 1; i--)
+    {
+        memcpy(internal_node_cell(parent, i), internal_node_cell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_cell(parent, index + 1) = new_child_page_num;
+    *internal_node_key(parent, index + 1) = *internal_node_key(parent, index);
+    *internal_node_key(parent, index) = left_max;
+}
+
+/* --- internal_node_split_and_insert --- */
+void internal_node_split_and_insert(cursor *cursor, uint32_t level, uint64_t left_max, uint64_t new_child_page_num)
+{
+    table *table = cursor->table;
+    pager *pager = table->pager;
+    uint64_t old_page_num = cursor->path[level];
+    uint32_t index = cursor->path_child[level];
+    void *old_node = get_page(pager, old_page_num);
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+
+    /* lay out every child in order; keys[i] is the max of children[i] and the
+       last child's max is not stored here (the parent already has it) */
+    uint64_t children[INTERNAL_NODE_MAX_CELLS + 2];
+    uint64_t keys[INTERNAL_NODE_MAX_CELLS + 2];
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        children[i] = *internal_node_cell(old_node, i);
+        keys[i] = *internal_node_key(old_node, i);
+    }
+    children[num_keys] = *internal_node_right_child(old_node);
+
+    for (uint32_t i = num_keys + 1; i > index + 1; i--)
+    {
+        children[i] = children[i - 1];
+        keys[i] = keys[i - 1];
+    }
+    children[index + 1] = new_child_page_num;
+    keys[index + 1] = keys[index];
+    keys[index] = left_max;
+
+    uint32_t total = num_keys + 2;
+    uint32_t left_count = (total + 1) / 2;
+
+    uint64_t new_page_num = get_unused_page_num(pager);
+    frame *new_frame = pager_latch(pager, new_page_num, true);
+    void *new_node = new_frame->data;
+    pager_mark_dirty(pager, old_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+
+    bool splitting_root = is_node_root(old_node);
+    initialize_internal_node(old_node);
+    set_node_root(old_node, splitting_root);
+
+    *internal_node_num_keys(old_node) = left_count - 1;
+    for (uint32_t i = 0; i + 1 < left_count; i++)
+    {
+        *internal_node_cell(old_node, i) = children[i];
+        *internal_node_key(old_node, i) = keys[i];
+    }
+    *internal_node_right_child(old_node) = children[left_count - 1];
+
+    *internal_node_num_keys(new_node) = total - left_count - 1;
+    for (uint32_t i = left_count; i + 1 < total; i++)
+    {
+        *internal_node_cell(new_node, i - left_count) = children[i];
+        *internal_node_key(new_node, i - left_count) = keys[i];
+    }
+    *internal_node_right_child(new_node) = children[total - 1];
+
+    if (splitting_root)
+    {
+        create_new_root(table, keys[left_count - 1], new_page_num);
+    }
+    else
+    {
+        internal_node_insert(cursor, level - 1, keys[left_count - 1], new_page_num);
+    }
+    pager_unlatch(new_frame);
+    if (pager->trace != NULL)
+        pager->trace->internal_splits++;
+}
+
+/* --- leaf insert (regular) --- */
+void leaf_node_insert(cursor *cursor, uint64_t key, row *value)
+{
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (num_cells >= leaf_node_max_cells(node))
+    {
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    if (cursor->cell_num < num_cells)
+    {
+        for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+        {
+            leaf_node_copy_cell(node, i, node, i - 1);
+        }
+    }
+
+    (*leaf_node_num_cells(node)) += 1;
+    *leaf_node_key(node, cursor->cell_num) = key;
+    leaf_node_write_row(cursor->table->dictionary, node, cursor->cell_num, value);
+}
+
+/* Largest key the cursor's leaf may hold: the separator in the nearest
+   ancestor where the path did not take the rightmost child. */
+uint64_t cursor_leaf_upper_bound(cursor *cursor)
+{
+    for (int32_t level = (int32_t)cursor->depth - 1; level >= 0; level--)
+    {
+        void *node = get_page(cursor->table->pager, cursor->path[level]);
+        if (cursor->path_child[level] < *internal_node_num_keys(node))
+            return *internal_node_key(node, cursor->path_child[level]);
+    }
+    return UINT64_MAX;
+}
+
+/* Merge sorted rows, all within the bounds of the cursor's leaf, into it.
+   If they do not fit, the merged cells are spread evenly over the leaf and
+   as many new leaves as needed, which are then linked into the parent. */
+void leaf_node_merge_rows(cursor *cursor, row *rows, uint32_t count)
+{
+    table *table = cursor->table;
+    pager *pager = table->pager;
+    void *node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    pager_mark_dirty(pager, cursor->page_num);
+
+    uint32_t max_cells = leaf_node_max_cells(node);
+    if (num_cells + count <= max_cells)
+    {
+        /* merge from the back so every existing cell moves at most once */
+        int32_t old_cell = (int32_t)num_cells - 1;
+        int32_t new_row = (int32_t)count - 1;
+        uint32_t cell = num_cells + count;
+        while (new_row >= 0)
+        {
+            cell--;
+            if (old_cell >= 0 && *leaf_node_key(node, old_cell) > rows[new_row].id)
+            {
+                leaf_node_copy_cell(node, cell, node, old_cell--);
+            }
+            else
+            {
+                *leaf_node_key(node, cell) = rows[new_row].id;
+                leaf_node_write_row(table->dictionary, node, cell, &rows[new_row--]);
+            }
+        }
+        *leaf_node_num_cells(node) = num_cells + count;
+        return;
+    }
+
+    double started = pager->trace != NULL ? clock_seconds() : 0;
+    uint32_t total = num_cells + count;
+    row *merged = malloc(total * sizeof(row));
+    uint32_t old_cell = 0, new_row = 0;
+    for (uint32_t k = 0; k < total; k++)
+    {
+        if (new_row == count || (old_cell < num_cells && *leaf_node_key(node, old_cell) < rows[new_row].id))
+        {
+            rowview view;
+            leaf_node_row_view(table->dictionary, node, old_cell++, &view);
+            materialize_row(&view, COLUMN_ALL, &merged[k]);
+        }
+        else
+        {
+            merged[k] = rows[new_row++];
+        }
+    }
+
+    /* the new pages are taken up front so each leaf can link to the next */
+    uint32_t num_leaves = (total + max_cells - 1) / max_cells;
+    uint64_t *page_nums = malloc(num_leaves * sizeof(uint64_t));
+    page_nums[0] = cursor->page_num;
+    for (uint32_t j = 1; j < num_leaves; j++)
+        page_nums[j] = get_unused_page_num(pager);
+    uint64_t last_next_leaf = *leaf_node_next_leaf(node);
+    leaflayout layout = leaf_node_layout(node);
+    uint32_t offset = 0;
+    for (uint32_t j = 0; j < num_leaves; j++)
+    {
+        uint64_t page_num = page_nums[j];
+        void *leaf = get_page(pager, page_num);
+        if (j > 0)
+        {
+            pager_mark_dirty(pager, page_num);
+            initialize_leaf_node(leaf, layout, pager->page_size);
+        }
+        uint32_t cells = total / num_leaves + (j < total % num_leaves ? 1 : 0);
+        for (uint32_t k = 0; k < cells; k++)
+        {
+            *leaf_node_key(leaf, k) = merged[offset + k].id;
+            leaf_node_write_row(table->dictionary, leaf, k, &merged[offset + k]);
+        }
+        offset += cells;
+        *leaf_node_num_cells(leaf) = cells;
+        *leaf_node_next_leaf(leaf) = j + 1 < num_leaves ? page_nums[j + 1] : last_next_leaf;
+        pager_unpin_all(pager);
+    }
+    free(merged);
+
+    /* Each new leaf takes over the upper part of its left neighbour's key
+       range; descending again keeps the path right when a parent splits. */
+    for (uint32_t j = 1; j < num_leaves; j++)
+    {
+        void *left = get_page(pager, page_nums[j - 1]);
+        uint64_t left_max = *leaf_node_key(left, *leaf_node_num_cells(left) - 1);
+
+        cursor->depth = 0;
+        table_find(table, left_max, cursor);
+        if (cursor->depth == 0)
+            create_new_root(table, left_max, page_nums[j]);
+        else
+            internal_node_insert(cursor, cursor->depth - 1, left_max, page_nums[j]);
+        pager_unpin_all(pager);
+    }
+    free(page_nums);
+    if (pager->trace != NULL)
+    {
+        pager->trace->leaf_splits += num_leaves - 1;
+        pager->trace->split_seconds += clock_seconds() - started;
+    }
+}
+
+int compare_rows_by_id(const void *a, const void *b)
+{
+    uint64_t left = ((const row *)a)->id;
+    uint64_t right = ((const row *)b)->id;
+    return (left > right) - (left < right);
+}
+
+/* A duplicate within the batch or with the table fails the whole batch
+   before anything is written. rows must be sorted. */
+bool table_has_any_key(table *table, row *rows, uint32_t count)
+{
+    for (uint32_t i = 1; i < count; i++)
+    {
+        if (rows[i].id == rows[i - 1].id)
+            return true;
+    }
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        cursor cursor;
+        table_find(table, rows[i].id, &cursor);
+        uint64_t bound = cursor_leaf_upper_bound(&cursor);
+        void *node = get_page(table->pager, cursor.page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t cell = cursor.cell_num;
+        for (; i < count && rows[i].id <= bound; i++)
+        {
+            while (cell < num_cells && *leaf_node_key(node, cell) < rows[i].id)
+                cell++;
+            if (cell < num_cells && *leaf_node_key(node, cell) == rows[i].id)
+                return true;
+        }
+        pager_unpin_all(table->pager);
+    }
+    return false;
+}
+
+/* Insert many rows at once: sorted, then one descent and one merge per leaf
+   they land in. Reorders rows. */
+executeresult table_insert_rows(table *table, row *rows, uint32_t count)
+{
+    qsort(rows, count, sizeof(row), compare_rows_by_id);
+    if (!table_rows_storable(table, rows, count))
+        return EXECUTE_EMAIL_NOT_STORABLE;
+    if (table_has_any_key(table, rows, count))
+        return EXECUTE_DUPLICATE_KEY;
+    if (!table_encode_rows(table, rows, count))
+        return EXECUTE_EMAIL_NOT_STORABLE;
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        pager_throttle(table->pager);
+        cursor cursor;
+        table_find(table, rows[i].id, &cursor);
+        uint64_t bound = cursor_leaf_upper_bound(&cursor);
+        uint32_t end = i;
+        while (end < count && rows[end].id <= bound)
+            end++;
+        leaf_node_merge_rows(&cursor, rows + i, end - i);
+        pager_unpin_all(table->pager);
+        i = end;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/* --- Concurrent inserts: latch coupling --- */
+/* table_insert_row may be called by many threads at once on one unsharded
+   table, as long as nothing else (selects, batches, vacuum, backup) runs
+   meanwhile. Every page it touches is latched first, parent before child. */
+
+/* Descend with shared latches hand over hand and latch only the leaf
+   exclusively, so writers in different leaves do not wait for each other.
+   Returns false, having changed nothing, when the leaf is full. */
+bool table_insert_optimistic(table *table, row *value, executeresult *result)
+{
+    pager *pager = table->pager;
+    double started = pager->trace != NULL ? clock_seconds() : 0;
+    cursor cursor;
+    uint32_t depth = 0;
+    frame *parent = NULL;
+    frame *node = pager_latch(pager, table->root_page_num, false);
+    while (get_node_type(node->data) == NODE_INTERNAL)
+    {
+        if (depth >= TABLE_MAX_DEPTH)
+        {
+            printf("Tree deeper than %d levels\n", TABLE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_index = internal_node_find_child(node->data, value->id);
+        uint64_t child_page_num = *internal_node_child(node->data, child_index);
+        cursor.path[depth] = node->page_num;
+        cursor.path_child[depth] = child_index;
+        depth++;
+        if (parent != NULL)
+            pager_unlatch(parent);
+        parent = node;
+        node = pager_latch(pager, child_page_num, false);
+    }
+
+    /* the parent's shared latch keeps the leaf from being split while its
+       latch is traded for an exclusive one */
+    uint64_t page_num = node->page_num;
+    pager_unlatch(node);
+    node = pager_latch(pager, page_num, true);
+    if (parent != NULL)
+        pager_unlatch(parent);
+
+    bool done = false;
+    if (get_node_type(node->data) == NODE_LEAF) /* a lone root may have split */
+    {
+        leaf_node_find(table, page_num, value->id, &cursor);
+        cursor.depth = depth;
+        if (pager->trace != NULL)
+            trace_descent(pager->trace, &cursor, started);
+        uint32_t num_cells = *leaf_node_num_cells(node->data);
+        if (cursor.cell_num < num_cells && *leaf_node_key(node->data, cursor.cell_num) == value->id)
+        {
+            *result = EXECUTE_DUPLICATE_KEY;
+            done = true;
+        }
+        else if (num_cells < leaf_node_max_cells(node->data))
+        {
+            *result = EXECUTE_EMAIL_NOT_STORABLE;
+            if (table_encode_rows(table, value, 1))
+            {
+                leaf_node_insert(&cursor, value->id, value);
+                *result = EXECUTE_SUCCESS;
+            }
+            done = true;
+        }
+    }
+    pager_unlatch(node);
+    return done;
+}
+
+/* Latch exclusively from the root down, letting go of everything above a
+   node that can take one more entry without splitting. The split then only
+   touches nodes this thread holds, plus new pages nobody else can reach. */
+executeresult table_insert_pessimistic(table *table, row *value)
+{
+    pager *pager = table->pager;
+    double started = pager->trace != NULL ? clock_seconds() : 0;
+    frame *held[TABLE_MAX_DEPTH + 1];
+    uint32_t first_held = 0;
+    uint32_t depth = 0;
+    cursor cursor;
+
+    held[0] = pager_latch(pager, table->root_page_num, true);
+    void *node = held[0]->data;
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        if (depth >= TABLE_MAX_DEPTH)
+        {
+            printf("Tree deeper than %d levels\n", TABLE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_index = internal_node_find_child(node, value->id);
+        cursor.path[depth] = held[depth]->page_num;
+        cursor.path_child[depth] = child_index;
+        held[depth + 1] = pager_latch(pager, *internal_node_child(node, child_index), true);
+        depth++;
+
+        node = held[depth]->data;
+        bool safe = get_node_type(node) == NODE_LEAF ? *leaf_node_num_cells(node) < leaf_node_max_cells(node)
+                                                     : *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
+        if (safe)
+        {
+            while (first_held < depth)
+                pager_unlatch(held[first_held++]);
+        }
+    }
+
+    executeresult result = EXECUTE_SUCCESS;
+    leaf_node_find(table, held[depth]->page_num, value->id, &cursor);
+    cursor.depth = depth;
+    if (pager->trace != NULL)
+        trace_descent(pager->trace, &cursor, started);
+    if (cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor.cell_num) == value->id)
+        result = EXECUTE_DUPLICATE_KEY;
+    else if (!table_encode_rows(table, value, 1))
+        result = EXECUTE_EMAIL_NOT_STORABLE;
+    else
+        leaf_node_insert(&cursor, value->id, value);
+
+    while (first_held <= depth)
+        pager_unlatch(held[first_held++]);
+    return result;
+}
+
+executeresult table_insert_row(table *table, row *value)
+{
+    executeresult result;
+    if (!table_rows_storable(table, value, 1))
+        return EXECUTE_EMAIL_NOT_STORABLE;
+    pager_throttle(table->pager);
+    if (!table_insert_optimistic(table, value, &result))
+        result = table_insert_pessimistic(table, value);
+    /* pages this thread used are all unlatched; other threads' are latched */
+    pager_unpin_all(table->pager);
+    return result;
+}
+
+/* --- pager flush / close --- */
+int compare_frame_page_nums(const void *a, const void *b)
+{
+    uint64_t left = (*(frame *const *)a)->page_num;
+    uint64_t right = (*(frame *const *)b)->page_num;
+    return (left > right) - (left < right);
+}
+
+/* Write back every dirty page in file order, merging runs of adjacent pages
+   into a single pwritev. */
+void pager_flush(pager *pager)
+{
+    pthread_mutex_lock(&pager->write_lock);
+    /* evicted pages being written back are clean already; let them land */
+    pthread_mutex_lock(&pager->lock);
+    while (pager->busy_frames > 0)
+        pthread_cond_wait(&pager->frame_ready, &pager->lock);
+    pthread_mutex_unlock(&pager->lock);
+    frame *dirty[PAGER_CACHE_PAGES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < pager->frames_used; i++)
+    {
+        if (pager->frames[i].dirty)
+            dirty[count++] = &pager->frames[i];
+    }
+    qsort(dirty, count, sizeof(dirty[0]), compare_frame_page_nums);
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        struct iovec iovecs[PAGER_FLUSH_MAX_IOVECS];
+        uint64_t first_page_num = dirty[i]->page_num;
+        uint32_t run = 0;
+        while (i + run < count && run < PAGER_FLUSH_MAX_IOVECS && dirty[i + run]->page_num == first_page_num + run)
+        {
+            iovecs[run].iov_base = dirty[i + run]->data;
+            iovecs[run].iov_len = pager->page_size;
+            run++;
+        }
+        for (uint32_t j = 0; j < run; j++)
+            pager_stamp_generation(pager, dirty[i + j]);
+        pager_write_run(pager, first_page_num, iovecs, run);
+        for (uint32_t j = 0; j < run; j++)
+            dirty[i + j]->dirty = false;
+        i += run;
+    }
+    atomic_fetch_sub_explicit(&pager->dirty_pages, count, memory_order_relaxed);
+    if (pager->shared != NULL)
+        shared_write_back(pager);
+    pthread_mutex_unlock(&pager->write_lock);
+}
+
+/* Forget every pending change; used when the file is being thrown away. */
+void pager_drop_dirty(pager *pager)
+{
+    pagewriter_stop(pager);
+    for (uint32_t i = 0; i < pager->frames_used; i++)
+        pager->frames[i].dirty = false;
+    atomic_store_explicit(&pager->dirty_pages, 0, memory_order_relaxed);
+}
+
+/* --- Background writer --- */
+void *pagewriter_worker(void *argument);
+
+void pagewriter_start(pager *pager, const dboptions *options)
+{
+    pagewriter *writer = calloc(1, sizeof(*writer));
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    pthread_cond_init(&writer->progress, NULL);
+    writer->rate = options->writer_rate;
+    uint32_t percent = options->dirty_high_water != 0 ? options->dirty_high_water : PAGEWRITER_HIGH_WATER_DEFAULT;
+    writer->high_water = (uint32_t)((uint64_t)PAGER_CACHE_PAGES * percent / 100);
+    /* the same kind of memory as the frames, so O_DIRECT can write it */
+    writer->staging = pager_allocate_slab((size_t)PAGEWRITER_BATCH * pager->page_size, &writer->staging_mapped);
+    pager->writer = writer;
+    if (pthread_create(&writer->thread, NULL, pagewriter_worker, pager) != 0)
+    {
+        printf("Unable to start background writer.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pagewriter_stop(pager *pager)
+{
+    pagewriter *writer = pager->writer;
+    if (writer == NULL)
+        return;
+    pthread_mutex_lock(&writer->lock);
+    writer->shutdown = true;
+    pthread_cond_broadcast(&writer->wake);
+    pthread_cond_broadcast(&writer->progress);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pager->writer = NULL;
+    pager_free_slab(writer->staging, (size_t)PAGEWRITER_BATCH * pager->page_size, writer->staging_mapped);
+    pthread_cond_destroy(&writer->wake);
+    pthread_cond_destroy(&writer->progress);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
+
+/* Write back up to max_pages of the oldest dirty pages that no statement is
+   using, and return how many were written. They are copied out and pinned
+   under pager->lock, so the write itself holds up nobody, and a page cannot
+   be evicted and read back before its new contents have reached the file. */
+uint32_t pagewriter_write_oldest(pager *pager, uint32_t max_pages)
+{
+    pagewriter *writer = pager->writer;
+    frame *batch[PAGEWRITER_BATCH];
+    uint32_t count = 0;
+    if (max_pages > PAGEWRITER_BATCH)
+        max_pages = PAGEWRITER_BATCH;
+    /* leave statements most of the cache even while a batch is pinned */
+    if (max_pages > PAGER_CACHE_PAGES / 4)
+        max_pages = PAGER_CACHE_PAGES / 4;
+
+    pthread_mutex_lock(&pager->write_lock);
+    pthread_mutex_lock(&pager->lock);
+    for (uint32_t i = 0; i < pager->frames_used && max_pages > 0; i++)
+    {
+        frame *frame = &pager->frames[i];
+        if (!frame->dirty || frame->last_used >= pager->epoch ||
+            atomic_load_explicit(&frame->pin_count, memory_order_acquire) != 0 ||
+            atomic_load_explicit(&frame->state, memory_order_acquire) != PAGE_READY)
+            continue;
+        if (count == max_pages && frame->dirtied_at >= batch[count - 1]->dirtied_at)
+            continue;
+
+        /* keep the batch sorted oldest first */
+        uint32_t position = count < max_pages ? count++ : count - 1;
+        while (position > 0 && batch[position - 1]->dirtied_at > frame->dirtied_at)
+        {
+            batch[position] = batch[position - 1];
+            position--;
+        }
+        batch[position] = frame;
+    }
+    qsort(batch, count, sizeof(batch[0]), compare_frame_page_nums);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pager_stamp_generation(pager, batch[i]);
+        memcpy(writer->staging + (size_t)i * pager->page_size, batch[i]->data, pager->page_size);
+        batch[i]->dirty = false;
+        atomic_fetch_add_explicit(&batch[i]->pin_count, 1, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&pager->dirty_pages, count, memory_order_relaxed);
+    writer->in_flight = count;
+    pthread_mutex_unlock(&pager->lock);
+
+    uint32_t write_calls = 0;
+    uint32_t i = 0;
+    while (i < count)
+    {
+        struct iovec iovecs[PAGEWRITER_BATCH];
+        uint32_t run = 0;
+        while (i + run < count && batch[i + run]->page_num == batch[i]->page_num + run)
+        {
+            iovecs[run].iov_base = writer->staging + (size_t)(i + run) * pager->page_size;
+            iovecs[run].iov_len = pager->page_size;
+            run++;
+        }
+        pager_write_pages(pager, batch[i]->page_num, iovecs, run);
+        write_calls++;
+        i += run;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    for (uint32_t j = 0; j < count; j++)
+    {
+        uint64_t end = (batch[j]->page_num + 1) * pager->page_size;
+        if (end > pager->file_length)
+            pager->file_length = end;
+        atomic_fetch_sub_explicit(&batch[j]->pin_count, 1, memory_order_release);
+    }
+    pager->pages_written += count;
+    pager->write_calls += write_calls;
+    writer->in_flight = 0;
+    pthread_mutex_unlock(&pager->lock);
+    pthread_mutex_unlock(&pager->write_lock);
+    return count;
+}
+
+/* Every tick, write as many pages as the rate allows; above the high-water
+   mark, write batch after batch until back under it. */
+void *pagewriter_worker(void *argument)
+{
+    pager *pager = argument;
+    pagewriter *writer = pager->writer;
+    double credit = 0;
+    double last = clock_seconds();
+
+    pthread_mutex_lock(&writer->lock);
+    while (!writer->shutdown)
+    {
+        bool urgent = atomic_load_explicit(&pager->dirty_pages, memory_order_relaxed) > writer->high_water;
+        if (!urgent)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)(PAGEWRITER_TICK_SECONDS * 1e9);
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&writer->wake, &writer->lock, &deadline);
+            if (writer->shutdown)
+                break;
+            urgent = atomic_load_explicit(&pager->dirty_pages, memory_order_relaxed) > writer->high_water;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        /* unused credit is capped at one batch, so an idle spell is not
+           followed by a burst */
+        double now = clock_seconds();
+        credit += (now - last) * writer->rate;
+        last = now;
+        if (credit > PAGEWRITER_BATCH)
+            credit = PAGEWRITER_BATCH;
+        uint32_t budget = urgent ? PAGEWRITER_BATCH : (uint32_t)credit;
+        uint32_t written = budget > 0 ? pagewriter_write_oldest(pager, budget) : 0;
+        if (!urgent)
+            credit -= written < budget ? credit : written;
+
+        pthread_mutex_lock(&writer->lock);
+        writer->pages_written += written;
+        writer->stuck = urgent && written == 0;
+        pthread_cond_broadcast(&writer->progress);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/* Called before an insert changes pages: past the high-water mark it waits
+   for the background writer to catch up. */
+void pager_throttle(pager *pager)
+{
+    pagewriter *writer = pager->writer;
+    if (writer == NULL || atomic_load_explicit(&pager->dirty_pages, memory_order_relaxed) <= writer->high_water)
+        return;
+
+    double started = clock_seconds();
+    pthread_mutex_lock(&writer->lock);
+    writer->stuck = false;
+    pthread_cond_signal(&writer->wake);
+    /* a writer that found nothing to write cannot help; go ahead then */
+    while (!writer->shutdown && !writer->stuck &&
+           atomic_load_explicit(&pager->dirty_pages, memory_order_relaxed) > writer->high_water)
+        pthread_cond_wait(&writer->progress, &writer->lock);
+    double waited = clock_seconds() - started;
+    writer->throttled++;
+    writer->throttled_seconds += waited;
+    if (waited > writer->longest_throttle)
+        writer->longest_throttle = waited;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void pager_close(pager *pager)
+{
+    pagewriter_stop(pager);
+    readahead_close(pager);
+    backup_finish(pager);
+
+    pager_flush(pager);
+    if (pager->shared != NULL)
+        shared_close(pager);
+    pager_free_slab(pager->slab, (size_t)PAGER_CACHE_PAGES * pager->page_size, pager->slab_mapped);
+    for (uint32_t i = 0; i < PAGER_CACHE_PAGES; i++)
+        pthread_rwlock_destroy(&pager->frames[i].latch);
+    pthread_mutex_destroy(&pager->lock);
+    pthread_mutex_destroy(&pager->write_lock);
+    pthread_cond_destroy(&pager->frame_ready);
+
+    int result = close(pager->file_descriptor);
+    if (result == -1)
+    {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(pager);
+}
+
+void db_close(table *table)
+{
+    if (table->num_shards > 0)
+    {
+        for (uint32_t i = 0; i < table->num_shards; i++)
+        {
+            shard *shard = &table->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            shard->job = SHARD_JOB_STOP;
+            pthread_cond_broadcast(&shard->changed);
+            pthread_mutex_unlock(&shard->lock);
+            pthread_join(shard->writer, NULL);
+            pthread_mutex_destroy(&shard->lock);
+            pthread_cond_destroy(&shard->changed);
+            db_close(shard->table);
+        }
+        free(table->shards);
+        free(table->filename);
+        free(table);
+        return;
+    }
+    vacuum_abandon(table);
+    pager_close(table->pager);
+    if (table->row_cache != NULL)
+        rowcache_close(table->row_cache);
+    if (table->dictionary != NULL)
+        email_dictionary_close(table->dictionary);
+    free(table->filename);
+    free(table);
+}
+
+/* --- Shards --- */
+
+uint32_t shard_for_key(table *table, uint64_t key)
+{
+    /* splitmix64 finalizer, so runs of ids spread over every shard */
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (uint32_t)(key % table->num_shards);
+}
+
+void *shard_writer(void *argument)
+{
+    shard *shard = argument;
+    pthread_mutex_lock(&shard->lock);
+    while (true)
+    {
+        while (shard->job == SHARD_JOB_NONE)
+            pthread_cond_wait(&shard->changed, &shard->lock);
+        if (shard->job == SHARD_JOB_STOP)
+            break;
+        pthread_mutex_unlock(&shard->lock);
+
+        table *table = shard->table;
+        pager_unpin_all(table->pager);
+        executeresult result = EXECUTE_SUCCESS;
+        switch (shard->job)
+        {
+        case SHARD_JOB_CHECK:
+            if (!table_rows_storable(table, shard->rows, shard->num_rows))
+                result = EXECUTE_EMAIL_NOT_STORABLE;
+            else if (table_has_any_key(table, shard->rows, shard->num_rows))
+                result = EXECUTE_DUPLICATE_KEY;
+            break;
+        case SHARD_JOB_INSERT:
+            result = table_insert_rows(table, shard->rows, shard->num_rows);
+            break;
+        case SHARD_JOB_SYNC:
+            pager_flush(table->pager);
+            if (fdatasync(table->pager->file_descriptor) == -1)
+            {
+                printf("fdatasync failed: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            break;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        shard->result = result;
+        shard->job = SHARD_JOB_NONE;
+        pthread_cond_broadcast(&shard->changed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+/* Give every shard with work the same job, then wait for all of them. Returns
+   the failure of a shard that failed, if any did. */
+executeresult shards_run(table *table, shardjob job)
+{
+    for (uint32_t i = 0; i < table->num_shards; i++)
+    {
+        shard *shard = &table->shards[i];
+        if (job != SHARD_JOB_SYNC && shard->num_rows == 0)
+            continue;
+        pthread_mutex_lock(&shard->lock);
+        shard->job = job;
+        pthread_cond_broadcast(&shard->changed);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    executeresult result = EXECUTE_SUCCESS;
+    for (uint32_t i = 0; i < table->num_shards; i++)
+    {
+        /* a shard left out still holds the result of its last job */
+        shard *shard = &table->shards[i];
+        if (job != SHARD_JOB_SYNC && shard->num_rows == 0)
+            continue;
+        pthread_mutex_lock(&shard->lock);
+        while (shard->job != SHARD_JOB_NONE)
+            pthread_cond_wait(&shard->changed, &shard->lock);
+        if (shard->result != EXECUTE_SUCCESS)
+            result = shard->result;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return result;
+}
+
+/* Split a batch by shard and let the writers insert their parts in
+   parallel: first all of them check for duplicates, then all insert. */
+executeresult sharded_insert_rows(table *table, row *rows, uint32_t count)
+{
+    uint32_t *counts = calloc(table->num_shards, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++)
+        counts[shard_for_key(table, rows[i].id)]++;
+    row *partitioned = malloc(count * sizeof(row));
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < table->num_shards; i++)
+    {
+        table->shards[i].rows = partitioned + offset;
+        table->shards[i].num_rows = 0;
+        offset += counts[i];
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        shard *shard = &table->shards[shard_for_key(table, rows[i].id)];
+        shard->rows[shard->num_rows++] = rows[i];
+    }
+    for (uint32_t i = 0; i < table->num_shards; i++)
+        qsort(table->shards[i].rows, table->shards[i].num_rows, sizeof(row), compare_rows_by_id);
+
+    executeresult result = shards_run(table, SHARD_JOB_CHECK);
+    if (result == EXECUTE_SUCCESS)
+        result = shards_run(table, SHARD_JOB_INSERT);
+
+    for (uint32_t i = 0; i < table->num_shards; i++)
+        table->shards[i].num_rows = 0;
+    free(partitioned);
+    free(counts);
+    return result;
+}
+
+/* Shard 0 is the named file itself, so its header says how many shards there
+   are; the others live next to it as <name>-shard<i>. */
+table *db_open(const char *filename, const dboptions *options)
+{
+    uint32_t num_shards;
+    table *first = table_open(filename, options, 0, &num_shards);
+    if (options->num_shards != 0 && options->num_shards != num_shards)
+        printf("%s was created with %u shards, using those.\n", filename, num_shards);
+    if (options->page_size != 0 && options->page_size != first->pager->page_size)
+        printf("%s was created with %u-byte pages, using those.\n", filename, first->pager->page_size);
+    if (num_shards <= 1)
+        return first;
+
+    table *table = calloc(1, sizeof(*table));
+    table->filename = strdup(filename);
+    table->options = *options;
+    table->options.num_shards = num_shards;
+    table->num_shards = num_shards;
+    table->shards = calloc(num_shards, sizeof(shard));
+    for (uint32_t i = 0; i < num_shards; i++)
+    {
+        shard *shard = &table->shards[i];
+        if (i == 0)
+        {
+            shard->table = first;
+        }
+        else
+        {
+            char path[PATH_MAX];
+            uint32_t count;
+            snprintf(path, sizeof(path), "%s-shard%u", filename, i);
+            shard->table = table_open(path, &table->options, i, &count);
+            if (count != num_shards)
+            {
+                printf("%s belongs to a database with %u shards, not %u.\n", path, count, num_shards);
+                exit(EXIT_FAILURE);
+            }
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->changed, NULL);
+        shard->job = SHARD_JOB_NONE;
+        if (pthread_create(&shard->writer, NULL, shard_writer, shard) != 0)
+        {
+            printf("Unable to start shard writer.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return table;
+}
+
+/* make every write so far durable */
+void db_sync(table *table)
+{
+    if (table->num_shards > 0)
+    {
+        shards_run(table, SHARD_JOB_SYNC);
+        return;
+    }
+    pager_flush(table->pager);
+    if (fdatasync(table->pager->file_descriptor) == -1)
+    {
+        printf("fdatasync failed: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Start a statement or meta command on a table opened with --shared, and
+   catch up with what other processes wrote. Shards are locked in order, so
+   two processes cannot each wait for a shard the other holds. */
+void table_shared_begin(table *table, bool write)
+{
+    if (table->num_shards > 0)
+    {
+        for (uint32_t i = 0; i < table->num_shards; i++)
+            table_shared_begin(table->shards[i].table, write);
+        return;
+    }
+    if (table->pager->shared == NULL)
+        return;
+
+    /* a new domain changes the last dictionary page, or the header if it is the first */
+    emaildictionary *dictionary = table->dictionary;
+    sharedchanges changes =
+        pager_shared_begin(table->pager, write, dictionary != NULL ? dictionary->last_page_num : INVALID_PAGE_NUM);
+    if (changes == SHARED_UNCHANGED)
+        return;
+    if (table->row_cache != NULL)
+        rowcache_clear(table->row_cache);
+    if (changes == SHARED_CHANGED_WATCHED && dictionary != NULL)
+    {
+        email_dictionary_close(dictionary);
+        uint64_t first_page_num = *header_dictionary_page_num(get_page(table->pager, 0));
+        table->dictionary = email_dictionary_open(table->pager, first_page_num);
+    }
+}
+
+void table_shared_end(table *table)
+{
+    if (table->num_shards > 0)
+    {
+        for (uint32_t i = 0; i < table->num_shards; i++)
+            table_shared_end(table->shards[i].table);
+        return;
+    }
+    if (table->pager->shared != NULL)
+        pager_shared_end(table->pager);
+}
+
+void merge_scan_open(mergescan *scan, table *table, scanpredicate *predicate)
+{
+    if (table->num_shards == 0)
+    {
+        scan->num_scans = 1;
+        scan->scans = malloc(sizeof(scanoperator));
+        scan->heads = NULL;
+        scan->live = NULL;
+        pager_unpin_all(table->pager);
+        scan_open(&scan->scans[0], table, predicate);
+        return;
+    }
+
+    /* a single id lives in exactly one shard */
+    uint32_t first = 0, end = table->num_shards;
+    if (predicate->id_min == predicate->id_max)
+    {
+        first = shard_for_key(table, predicate->id_min);
+        end = first + 1;
+    }
+    scan->num_scans = end - first;
+    scan->scans = malloc(scan->num_scans * sizeof(scanoperator));
+    scan->heads = malloc(scan->num_scans * sizeof(row));
+    scan->live = malloc(scan->num_scans * sizeof(bool));
+    for (uint32_t i = 0; i < scan->num_scans; i++)
+    {
+        shard *shard = &table->shards[first + i];
+        pager_unpin_all(shard->table->pager);
+        scan_open(&scan->scans[i], shard->table, predicate);
+        scan->live[i] = scan_next(&scan->scans[i], &scan->heads[i]);
+    }
+}
+
+/* next row in key order across all shards, or reverse key order */
+bool merge_scan_next(mergescan *scan, row *destination)
+{
+    if (scan->heads == NULL)
+        return scan_next(&scan->scans[0], destination);
+
+    bool descending = scan->scans[0].predicate->descending;
+    int32_t next = -1;
+    for (uint32_t i = 0; i < scan->num_scans; i++)
+    {
+        if (scan->live[i] && (next == -1 || (descending ? scan->heads[i].id > scan->heads[next].id
+                                                          : scan->heads[i].id < scan->heads[next].id)))
+            next = (int32_t)i;
+    }
+    if (next == -1)
+        return false;
+    *destination = scan->heads[next];
+    scan->live[next] = scan_next(&scan->scans[next], &scan->heads[next]);
+    return true;
+}
+
+void merge_scan_close(mergescan *scan)
+{
+    for (uint32_t i = 0; i < scan->num_scans; i++)
+        scan_close(&scan->scans[i]);
+    free(scan->scans);
+    free(scan->heads);
+    free(scan->live);
+}
+
+/* --- Row cache --- */
+
+uint64_t rowcache_hash(uint64_t id, uint32_t seed)
+{
+    id += (seed + 1) * 0x9e3779b97f4a7c15ULL;
+    id ^= id >> 30;
+    id *= 0xbf58476d1ce4e5b9ULL;
+    id ^= id >> 27;
+    id *= 0x94d049bb133111ebULL;
+    id ^= id >> 31;
+    return id;
+}
+
+rowcache *rowcache_open(uint32_t capacity)
+{
+    rowcache *cache = calloc(1, sizeof(*cache));
+    cache->capacity = capacity;
+    cache->entries = malloc(capacity * sizeof(rowcacheentry));
+    uint32_t buckets = 1;
+    while (buckets < capacity)
+        buckets <<= 1;
+    cache->bucket_mask = buckets - 1;
+    cache->buckets = malloc(buckets * sizeof(int32_t));
+    for (uint32_t i = 0; i < buckets; i++)
+        cache->buckets[i] = -1;
+    /* about two counters per entry in each row of the sketch */
+    cache->sketch_mask = buckets * 2 - 1;
+    cache->sketch = calloc(ROWCACHE_SKETCH_DEPTH, (size_t)buckets * 2);
+    cache->free_list = -1;
+    cache->newest = -1;
+    cache->oldest = -1;
+    return cache;
+}
+
+void rowcache_close(rowcache *cache)
+{
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->sketch);
+    free(cache);
+}
+
+uint8_t *rowcache_counter(rowcache *cache, uint64_t id, uint32_t row)
+{
+    return &cache->sketch[row * (cache->sketch_mask + 1) + (rowcache_hash(id, row) & cache->sketch_mask)];
+}
+
+/* how often id was looked up lately: the smallest of its counters */
+uint32_t rowcache_frequency(rowcache *cache, uint64_t id)
+{
+    uint32_t frequency = ROWCACHE_COUNTER_MAX;
+    for (uint32_t i = 0; i < ROWCACHE_SKETCH_DEPTH; i++)
+    {
+        uint8_t counter = *rowcache_counter(cache, id, i);
+        if (counter < frequency)
+            frequency = counter;
+    }
+    return frequency;
+}
+
+void rowcache_record(rowcache *cache, uint64_t id)
+{
+    for (uint32_t i = 0; i < ROWCACHE_SKETCH_DEPTH; i++)
+    {
+        uint8_t *counter = rowcache_counter(cache, id, i);
+        if (*counter < ROWCACHE_COUNTER_MAX)
+            (*counter)++;
+    }
+    /* halve every counter now and then so ids that went cold fade out */
+    if (++cache->sketch_count >= (uint64_t)cache->capacity * ROWCACHE_SAMPLE_FACTOR)
+    {
+        size_t size = (size_t)ROWCACHE_SKETCH_DEPTH * (cache->sketch_mask + 1);
+        for (size_t i = 0; i < size; i++)
+            cache->sketch[i] >>= 1;
+        cache->sketch_count /= 2;
+    }
+}
+
+int32_t rowcache_find(rowcache *cache, uint64_t id)
+{
+    int32_t index = cache->buckets[rowcache_hash(id, ROWCACHE_SKETCH_DEPTH) & cache->bucket_mask];
+    while (index != -1 && cache->entries[index].id != id)
+        index = cache->entries[index].hash_next;
+    return index;
+}
+
+void rowcache_unlink(rowcache *cache, int32_t index)
+{
+    rowcacheentry *entry = &cache->entries[index];
+    if (entry->newer != -1)
+        cache->entries[entry->newer].older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older != -1)
+        cache->entries[entry->older].newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+void rowcache_push_newest(rowcache *cache, int32_t index)
+{
+    rowcacheentry *entry = &cache->entries[index];
+    entry->newer = -1;
+    entry->older = cache->newest;
+    if (cache->newest != -1)
+        cache->entries[cache->newest].newer = index;
+    else
+        cache->oldest = index;
+    cache->newest = index;
+}
+
+/* take the entry off both its bucket chain and the recency list */
+void rowcache_remove(rowcache *cache, int32_t index)
+{
+    int32_t *link = &cache->buckets[rowcache_hash(cache->entries[index].id, ROWCACHE_SKETCH_DEPTH) & cache->bucket_mask];
+    while (*link != index)
+        link = &cache->entries[*link].hash_next;
+    *link = cache->entries[index].hash_next;
+    rowcache_unlink(cache, index);
+}
+
+/* The cached entry for id, or NULL on a miss. Counts the lookup either way. */
+rowcacheentry *rowcache_get(rowcache *cache, uint64_t id)
+{
+    rowcache_record(cache, id);
+    int32_t index = rowcache_find(cache, id);
+    if (index == -1)
+    {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    rowcache_unlink(cache, index);
+    rowcache_push_newest(cache, index);
+    return &cache->entries[index];
+}
+
+/* Remember the row of id, or that there is none when source is NULL. */
+void rowcache_put(rowcache *cache, uint64_t id, row *source)
+{
+    int32_t index = rowcache_find(cache, id);
+    if (index != -1)
+    {
+        rowcache_remove(cache, index);
+    }
+    else if (cache->free_list != -1)
+    {
+        index = cache->free_list;
+        cache->free_list = cache->entries[index].hash_next;
+        cache->num_free--;
+    }
+    else if (cache->used < cache->capacity)
+    {
+        index = (int32_t)cache->used++;
+    }
+    else
+    {
+        /* full: admit the new id only if it is looked up more than the victim */
+        index = cache->oldest;
+        if (rowcache_frequency(cache, id) <= rowcache_frequency(cache, cache->entries[index].id))
+        {
+            cache->rejected++;
+            return;
+        }
+        rowcache_remove(cache, index);
+    }
+    cache->admitted++;
+
+    rowcacheentry *entry = &cache->entries[index];
+    entry->id = id;
+    entry->present = source != NULL;
+    if (source != NULL)
+        entry->row = *source;
+    int32_t *bucket = &cache->buckets[rowcache_hash(id, ROWCACHE_SKETCH_DEPTH) & cache->bucket_mask];
+    entry->hash_next = *bucket;
+    *bucket = index;
+    rowcache_push_newest(cache, index);
+}
+
+/* Drop every entry; the counts seen by the sketch are kept. */
+void rowcache_clear(rowcache *cache)
+{
+    for (uint32_t i = 0; i <= cache->bucket_mask; i++)
+        cache->buckets[i] = -1;
+    cache->invalidated += cache->used - cache->num_free;
+    cache->used = 0;
+    cache->free_list = -1;
+    cache->num_free = 0;
+    cache->newest = -1;
+    cache->oldest = -1;
+}
+
+void rowcache_invalidate(rowcache *cache, uint64_t id)
+{
+    int32_t index = rowcache_find(cache, id);
+    if (index == -1)
+        return;
+    rowcache_remove(cache, index);
+    cache->entries[index].hash_next = cache->free_list;
+    cache->free_list = index;
+    cache->num_free++;
+    cache->invalidated++;
+}
+
+/* Point lookup of one id, through the row cache when the tree has one.
+   Returns whether the id exists; the whole row is copied on success. */
+bool table_lookup(table *table, uint64_t id, row *destination)
+{
+    if (table->num_shards > 0)
+        table = table->shards[shard_for_key(table, id)].table;
+    rowcache *cache = table->row_cache;
+    if (cache != NULL)
+    {
+        rowcacheentry *entry = rowcache_get(cache, id);
+        if (entry != NULL)
+        {
+            if (entry->present)
+                *destination = entry->row;
+            return entry->present;
+        }
+    }
+
+    pager_unpin_all(table->pager);
+    cursor cursor;
+    table_find(table, id, &cursor);
+    void *node = get_page(table->pager, cursor.page_num);
+    bool found = cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor.cell_num) == id;
+    if (found)
+    {
+        rowview view;
+        leaf_node_row_view(table->dictionary, node, cursor.cell_num, &view);
+        materialize_row(&view, COLUMN_ALL, destination);
+    }
+    if (cache != NULL)
+        rowcache_put(cache, id, found ? destination : NULL);
+    return found;
+}
+
+/* Drop whatever the row caches hold for ids about to be written. */
+void table_forget_rows(table *table, row *rows, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        rowcache *cache = table->num_shards > 0 ? table->shards[shard_for_key(table, rows[i].id)].table->row_cache
+                                                : table->row_cache;
+        if (cache != NULL)
+            rowcache_invalidate(cache, rows[i].id);
+    }
+}
+
+void print_row_cache_stats(rowcache *cache)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+    printf("Row cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " admitted, %" PRIu64
+           " rejected, %" PRIu64 " invalidated, %u of %u entries in use\n",
+           cache->hits, cache->misses, lookups > 0 ? 100.0 * cache->hits / lookups : 0.0, cache->admitted,
+           cache->rejected, cache->invalidated, cache->used - cache->num_free, cache->capacity);
+}
+
+/* --- Vacuum --- */
+
+#define VACUUM_SLICE_PAGES 64 /* pages read or built per vacuum_step */
+
+bool vacuum_start(table *table)
+{
+    if (table->vacuum != NULL)
+    {
+        printf("A vacuum is already running.\n");
+        return false;
+    }
+    backup *running = table->pager->backup;
+    if (running != NULL && !atomic_load_explicit(&running->finished, memory_order_acquire))
+    {
+        printf("A backup is running.\n");
+        return false;
+    }
+
+    vacuum *vacuum = calloc(1, sizeof(*vacuum));
+    snprintf(vacuum->path, sizeof(vacuum->path), "%s-vacuum", table->filename);
+    unlink(vacuum->path);
+    dboptions options = table->options;
+    options.page_size = table->pager->page_size;
+    vacuum->pager = pager_open(vacuum->path, &options);
+    vacuum->pager->generation = table->pager->generation;
+    vacuum->old_pages = table->pager->num_pages;
+
+    void *header = get_page(vacuum->pager, 0);
+    pager_mark_dirty(vacuum->pager, 0);
+    initialize_file_header(header, options.page_size);
+    *header_generation(header) = table->pager->generation;
+    void *old_header = get_page(table->pager, 0);
+    *header_shard_count(header) = *header_shard_count(old_header);
+    *header_shard_index(header) = *header_shard_index(old_header);
+
+    table->vacuum = vacuum;
+    return true;
+}
+
+void vacuum_add_node(uint64_t **max_keys, uint64_t **page_nums, uint64_t *count, uint64_t max_key, uint64_t page_num)
+{
+    /* grow in powers of two */
+    if ((*count & (*count - 1)) == 0)
+    {
+        uint64_t capacity = *count ? *count * 2 : 64;
+        *max_keys = realloc(*max_keys, capacity * sizeof(uint64_t));
+        *page_nums = realloc(*page_nums, capacity * sizeof(uint64_t));
+    }
+    (*max_keys)[*count] = max_key;
+    (*page_nums)[*count] = page_num;
+    (*count)++;
+}
+
+/* append one cell of an old leaf to the leaf being filled */
+void vacuum_copy_cell(vacuum *vacuum, void *source, uint32_t cell_num)
+{
+    pager *pager = vacuum->pager;
+    void *leaf = vacuum->leaf_page_num ? get_page(pager, vacuum->leaf_page_num) : NULL;
+    /* filled over several slices, and may have been written back in between */
+    if (leaf != NULL)
+        pager_mark_dirty(pager, vacuum->leaf_page_num);
+    if (leaf == NULL || *leaf_node_num_cells(leaf) == leaf_node_max_cells(leaf))
+    {
+        uint64_t page_num = get_unused_page_num(pager);
+        if (leaf != NULL)
+            *leaf_node_next_leaf(leaf) = page_num;
+        leaf = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        initialize_leaf_node(leaf, leaf_node_layout(source), pager->page_size);
+        vacuum_add_node(&vacuum->max_keys, &vacuum->page_nums, &vacuum->num_nodes, 0, page_num);
+        vacuum->leaf_page_num = page_num;
+    }
+    uint32_t cell = (*leaf_node_num_cells(leaf))++;
+    leaf_node_copy_cell(leaf, cell, source, cell_num);
+    vacuum->max_keys[vacuum->num_nodes - 1] = *leaf_node_key(leaf, cell);
+    vacuum->rows_copied++;
+}
+
+/* group the next nodes of the level below into one internal node, as evenly as
+   the level allows */
+void vacuum_build_internal_node(vacuum *vacuum)
+{
+    pager *pager = vacuum->pager;
+    uint64_t fanout = INTERNAL_NODE_MAX_CELLS + 1;
+    uint64_t num_groups = (vacuum->num_nodes + fanout - 1) / fanout;
+    uint64_t group = vacuum->num_parents;
+    uint64_t first = group * (vacuum->num_nodes / num_groups) + (group < vacuum->num_nodes % num_groups ? group : vacuum->num_nodes % num_groups);
+    uint64_t count = vacuum->num_nodes / num_groups + (group < vacuum->num_nodes % num_groups ? 1 : 0);
+
+    uint64_t page_num = get_unused_page_num(pager);
+    void *node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    initialize_internal_node(node);
+    *internal_node_num_keys(node) = count - 1;
+    for (uint64_t i = 0; i + 1 < count; i++)
+    {
+        *internal_node_child(node, i) = vacuum->page_nums[first + i];
+        *internal_node_key(node, i) = vacuum->max_keys[first + i];
+    }
+    *internal_node_right_child(node) = vacuum->page_nums[first + count - 1];
+    vacuum_add_node(&vacuum->parent_max_keys, &vacuum->parent_page_nums, &vacuum->num_parents,
+                    vacuum->max_keys[first + count - 1], page_num);
+    vacuum->nodes_grouped = first + count;
+}
+
+/* switch to the new file, catch up on late inserts and make it durable */
+void vacuum_finish(table *table)
+{
+    vacuum *vacuum = table->vacuum;
+    pager *old_pager = table->pager;
+    pager *new_pager = vacuum->pager;
+    if (vacuum->num_nodes == 0)
+    {
+        /* empty table: a lone root leaf */
+        uint64_t page_num = get_unused_page_num(new_pager);
+        leaflayout layout = leaf_node_layout(get_page(old_pager, table->root_page_num));
+        initialize_leaf_node(get_page(new_pager, page_num), layout, new_pager->page_size);
+        pager_mark_dirty(new_pager, page_num);
+        vacuum_add_node(&vacuum->max_keys, &vacuum->page_nums, &vacuum->num_nodes, 0, page_num);
+    }
+    uint64_t root_page_num = vacuum->page_nums[0];
+    set_node_root(get_page(new_pager, root_page_num), true);
+    pager_mark_dirty(new_pager, root_page_num);
+    *header_root_page_num(get_page(new_pager, 0)) = root_page_num;
+    pager_mark_dirty(new_pager, 0);
+
+    /* whatever the old file still had pending is superseded */
+    pager_drop_dirty(old_pager);
+    pager_close(old_pager);
+    table->pager = new_pager;
+    table->root_page_num = root_page_num;
+    vacuum->pager = NULL;
+    /* copied cells keep their domain codes */
+    if (table->dictionary != NULL)
+        email_dictionary_rewrite(table->dictionary, new_pager);
+
+    pager_unpin_all(new_pager);
+    if (vacuum->num_late_rows > 0)
+        table_insert_rows(table, vacuum->late_rows, vacuum->num_late_rows);
+    pager_flush(new_pager);
+    if (fsync(new_pager->file_descriptor) == -1 || rename(vacuum->path, table->filename) == -1)
+    {
+        printf("Vacuum failed: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Vacuum done: %" PRIu64 " pages now %" PRIu64 ".\n", vacuum->old_pages, new_pager->num_pages);
+    vacuum_abandon(table);
+}
+
+/* Do one bounded slice of the vacuum. Returns false once it is over. */
+bool vacuum_step(table *table)
+{
+    vacuum *vacuum = table->vacuum;
+    if (vacuum == NULL)
+        return false;
+
+    if (vacuum->phase == VACUUM_COPY_LEAVES)
+    {
+        cursor cursor;
+        table_find(table, vacuum->next_key, &cursor);
+        for (uint32_t pages = 0; pages < VACUUM_SLICE_PAGES && !vacuum->copied_all; pages++)
+        {
+            void *node = get_page(table->pager, cursor.page_num);
+            uint32_t num_cells = *leaf_node_num_cells(node);
+            for (uint32_t cell = cursor.cell_num; cell < num_cells; cell++)
+                vacuum_copy_cell(vacuum, node, cell);
+            if (num_cells > cursor.cell_num)
+            {
+                uint64_t last_key = *leaf_node_key(node, num_cells - 1);
+                vacuum->copied_all = last_key == UINT64_MAX;
+                vacuum->next_key = last_key + 1;
+            }
+            cursor.page_num = *leaf_node_next_leaf(node);
+            cursor.cell_num = 0;
+            if (cursor.page_num == 0)
+                vacuum->copied_all = true;
+            pager_unpin_all(table->pager);
+            pager_unpin_all(vacuum->pager);
+        }
+        if (vacuum->copied_all)
+            vacuum->phase = VACUUM_BUILD_INTERNAL;
+        return true;
+    }
+
+    for (uint32_t pages = 0; pages < VACUUM_SLICE_PAGES && vacuum->num_nodes > 1; pages++)
+    {
+        vacuum_build_internal_node(vacuum);
+        pager_unpin_all(vacuum->pager);
+        if (vacuum->nodes_grouped == vacuum->num_nodes)
+        {
+            /* level done, build the one above it next */
+            free(vacuum->max_keys);
+            free(vacuum->page_nums);
+            vacuum->max_keys = vacuum->parent_max_keys;
+            vacuum->page_nums = vacuum->parent_page_nums;
+            vacuum->num_nodes = vacuum->num_parents;
+            vacuum->parent_max_keys = vacuum->parent_page_nums = NULL;
+            vacuum->num_parents = vacuum->nodes_grouped = 0;
+        }
+    }
+    if (vacuum->num_nodes <= 1)
+    {
+        vacuum_finish(table);
+        return false;
+    }
+    return true;
+}
+
+/* Rows the copy has already passed must be carried over at the end. */
+void vacuum_note_rows(table *table, row *rows, uint32_t count)
+{
+    vacuum *vacuum = table->vacuum;
+    if (vacuum == NULL)
+        return;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!vacuum->copied_all && rows[i].id >= vacuum->next_key)
+            continue;
+        if (vacuum->num_late_rows == vacuum->late_rows_capacity)
+        {
+            vacuum->late_rows_capacity = vacuum->late_rows_capacity ? vacuum->late_rows_capacity * 2 : 64;
+            vacuum->late_rows = realloc(vacuum->late_rows, vacuum->late_rows_capacity * sizeof(row));
+        }
+        vacuum->late_rows[vacuum->num_late_rows++] = rows[i];
+    }
+}
+
+/* stop a vacuum and drop its file; the database is left as it was */
+void vacuum_abandon(table *table)
+{
+    vacuum *vacuum = table->vacuum;
+    if (vacuum == NULL)
+        return;
+    if (vacuum->pager != NULL)
+    {
+        pager_drop_dirty(vacuum->pager);
+        pager_close(vacuum->pager);
+        unlink(vacuum->path);
+    }
+    free(vacuum->max_keys);
+    free(vacuum->page_nums);
+    free(vacuum->parent_max_keys);
+    free(vacuum->parent_page_nums);
+    free(vacuum->late_rows);
+    free(vacuum);
+    table->vacuum = NULL;
+}
+
+typedef struct
+{
+    uint64_t leaves;
+    uint64_t internal_nodes;
+    uint64_t cells;
+    uint64_t capacity; /* cells the leaves have room for */
+} treecounts;
+
+void count_tree_nodes(pager *pager, uint64_t page_num, treecounts *counts)
+{
+    void *node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_LEAF)
+    {
+        counts->leaves++;
+        counts->cells += *leaf_node_num_cells(node);
+        counts->capacity += leaf_node_max_cells(node);
+        return;
+    }
+    counts->internal_nodes++;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint64_t children[INTERNAL_NODE_MAX_CELLS + 1];
+    for (uint32_t i = 0; i < num_keys; i++)
+        children[i] = *internal_node_child(node, i);
+    children[num_keys] = *internal_node_right_child(node);
+    for (uint32_t i = 0; i <= num_keys; i++)
+    {
+        pager_unpin_all(pager);
+        count_tree_nodes(pager, children[i], counts);
+    }
+}
+
+/* fill factor of the leaves and how often the next leaf is also the next page */
+void print_fragmentation(table *table)
+{
+    pager *pager = table->pager;
+    treecounts counts = {0};
+    count_tree_nodes(pager, table->root_page_num, &counts);
+
+    cursor cursor;
+    pager_unpin_all(pager);
+    table_start(table, &cursor);
+    uint64_t page_num = cursor.page_num;
+    uint64_t sequential = 0, backward = 0, distance = 0;
+    while (true)
+    {
+        uint64_t next = *leaf_node_next_leaf(get_page(pager, page_num));
+        pager_unpin_all(pager);
+        if (next == 0)
+            break;
+        if (next == page_num + 1)
+            sequential++;
+        if (next < page_num)
+            backward++;
+        distance += next > page_num ? next - page_num : page_num - next;
+        page_num = next;
+    }
+
+    /* the domain dictionary's pages are in use too */
+    uint64_t dictionary_pages = 0;
+    page_num = *header_dictionary_page_num(get_page(pager, 0));
+    while (page_num != 0)
+    {
+        dictionary_pages++;
+        page_num = *(uint64_t *)((char *)get_page(pager, page_num) + DICTIONARY_NEXT_PAGE_OFFSET);
+        pager_unpin_all(pager);
+    }
+
+    uint64_t links = counts.leaves - 1;
+    uint64_t unused = pager->num_pages - 1 - counts.leaves - counts.internal_nodes - dictionary_pages;
+    printf("Pages: %" PRIu64 ", leaves: %" PRIu64 ", internal: %" PRIu64, pager->num_pages, counts.leaves,
+           counts.internal_nodes);
+    if (table->dictionary != NULL)
+        printf(", dictionary: %" PRIu64, dictionary_pages);
+    printf(", unused: %" PRIu64 "\n", unused);
+    printf("Leaf fill: %.1f%% (%" PRIu64 " of %" PRIu64 " cells)\n",
+           100.0 * counts.cells / counts.capacity, counts.cells, counts.capacity);
+    printf("Leaf order: %" PRIu64 " of %" PRIu64 " next-leaf steps go to the following page, %" PRIu64
+           " go backwards, %.1f pages apart on average\n",
+           sequential, links, backward, links ? (double)distance / links : 0.0);
+}
+
+/* --- input buffer --- */
+inputbuffer *new_input_buffer()
+{
+    inputbuffer *input_buffer = malloc(sizeof(inputbuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+    return input_buffer;
+}
+
+void print_prompt()
+{
+    printf("Sup boy>");
+    fflush(stdout);
+}
+
+void read_input(inputbuffer *input_buffer)
+{
+    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    if (bytes_read <= 0)
+    {
+        printf("Error reading Input\n");
+        exit(EXIT_FAILURE);
+    }
+    input_buffer->input_length = bytes_read - 1;
+    input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+/* true when a line is waiting, so background work should yield */
+bool input_pending()
+{
+#ifndef _WIN32
+    struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+    return poll(&input, 1, 0) != 0;
+#else
+    return true;
+#endif
+}
+
+void close_input_buffer(inputbuffer *input_buffer)
+{
+    free(input_buffer->buffer);
+    free(input_buffer);
+}
+
+/* --- printing / tree debug --- */
+void indent(uint32_t level)
+{
+    for (uint32_t i = 0; i < level; i++)
+    {
+        printf("  ");
+    }
+}
+
+void print_tree(pager *pager, uint64_t page_num, uint32_t indentation_level)
+{
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys;
+
+    switch (get_node_type(node))
+    {
+    case (NODE_LEAF):
+        num_keys = *leaf_node_num_cells(node);
+        indent(indentation_level);
+        printf("- leaf (size %d)\n", num_keys);
+        for (uint32_t i = 0; i < num_keys; i++)
+        {
+            indent(indentation_level + 1);
+            printf("- %" PRIu64 "\n", *leaf_node_key(node, i));
+        }
+        break;
+    case (NODE_INTERNAL):
+        num_keys = *internal_node_num_keys(node);
+        indent(indentation_level);
+        printf("- internal (size %d)\n", num_keys);
+        if (num_keys > 0)
+        {
+            /* copy the node out: the whole tree may not fit in the cache at once */
+            uint64_t children[INTERNAL_NODE_MAX_CELLS + 1];
+            uint64_t keys[INTERNAL_NODE_MAX_CELLS];
+            for (uint32_t i = 0; i < num_keys; i++)
+            {
+                children[i] = *internal_node_child(node, i);
+                keys[i] = *internal_node_key(node, i);
+            }
+            children[num_keys] = *internal_node_right_child(node);
+
+            for (uint32_t i = 0; i < num_keys; i++)
+            {
+                pager_unpin_all(pager);
+                print_tree(pager, children[i], indentation_level + 1);
+
+                indent(indentation_level + 1);
+                printf("- key %" PRIu64 "\n", keys[i]);
+            }
+            pager_unpin_all(pager);
+            print_tree(pager, children[num_keys], indentation_level + 1);
+        }
+        else
+        {
+            /* empty internal node: nothing to print */
+        }
+        break;
+    }
+}
+
+/* --- meta commands / statement preparation / execute --- */
+metacommandresult do_meta_command(inputbuffer *input_buffer, table *table)
+{
+    if (strcmp(input_buffer->buffer, ".exit") == 0)
+    {
+        close_input_buffer(input_buffer);
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+    else if (table->num_shards > 0)
+    {
+        /* per-file commands run on each shard in turn */
+        if (strcmp(input_buffer->buffer, ".btree") != 0 && strcmp(input_buffer->buffer, ".stats") != 0 &&
+            strcmp(input_buffer->buffer, ".fragmentation") != 0)
+        {
+            printf("Not available on a sharded database.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        for (uint32_t i = 0; i < table->num_shards; i++)
+        {
+            printf("Shard %u:\n", i);
+            do_meta_command(input_buffer, table->shards[i].table);
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else if (table->pager->shared != NULL &&
+             (strcmp(input_buffer->buffer, ".vacuum") == 0 || strncmp(input_buffer->buffer, ".backup", 7) == 0))
+    {
+        /* both assume this process is the only one writing the file */
+        printf("Not available on a shared database.\n");
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".constants") == 0)
+    {
+        uint32_t page_size = table->pager->page_size;
+        printf("Constants:\n");
+        printf("PAGE_SIZE: %u\n", page_size);
+        printf("ROW_SIZE: %zu\n", ROW_SIZE);
+        printf("LEAF_NODE_CELL_SIZE: %zu\n", LEAF_NODE_CELL_SIZE);
+        printf("LEAF_NODE_MAX_CELLS: %zu\n", LEAF_NODE_MAX_CELLS(page_size));
+        printf("LEAF_DICT_CELL_SIZE: %zu\n", LEAF_DICT_CELL_SIZE);
+        printf("LEAF_DICT_MAX_CELLS: %zu\n", LEAF_DICT_MAX_CELLS(page_size));
+        printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".btree") == 0)
+    {
+        printf("Tree:\n");
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".stats") == 0)
+    {
+        uint32_t dirty_pages = 0;
+        for (uint32_t i = 0; i < table->pager->frames_used; i++)
+        {
+            if (table->pager->frames[i].dirty)
+                dirty_pages++;
+        }
+        printf("Pages: %" PRIu64 ", cached: %d, dirty: %d\n", table->pager->num_pages, table->pager->frames_used,
+               dirty_pages);
+        printf("Pages read: %llu, written: %llu in %llu writes\n", (unsigned long long)table->pager->pages_read,
+               (unsigned long long)table->pager->pages_written, (unsigned long long)table->pager->write_calls);
+        if (table->pager->direct_io)
+            printf("Direct I/O: on\n");
+        pagewriter *writer = table->pager->writer;
+        if (writer != NULL)
+        {
+            pthread_mutex_lock(&writer->lock);
+            printf("Background writer: %" PRIu64 " pages written; %" PRIu64
+                   " inserts throttled for %.1f ms, longest %.1f ms\n",
+                   writer->pages_written, writer->throttled, writer->throttled_seconds * 1e3,
+                   writer->longest_throttle * 1e3);
+            pthread_mutex_unlock(&writer->lock);
+        }
+        if (table->row_cache != NULL)
+            print_row_cache_stats(table->row_cache);
+        if (table->dictionary != NULL)
+            printf("Email domains: %u\n", atomic_load(&table->dictionary->count));
+        if (table->pager->shared != NULL)
+            print_shared_stats(table->pager);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".fragmentation") == 0)
+    {
+        print_fragmentation(table);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".vacuum") == 0)
+    {
+        vacuum *vacuum = table->vacuum;
+        if (vacuum != NULL)
+            printf("Vacuum %s: %" PRIu64 " rows copied into %" PRIu64 " pages, %u late inserts\n",
+                   vacuum->phase == VACUUM_COPY_LEAVES ? "copying leaves" : "building internal nodes",
+                   vacuum->rows_copied, vacuum->pager->num_pages, vacuum->num_late_rows);
+        else if (vacuum_start(table))
+            printf("Vacuum started.\n");
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".backup") == 0)
+    {
+        backup *backup = table->pager->backup;
+        if (backup == NULL)
+        {
+            printf("No backup has run.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        bool finished = atomic_load_explicit(&backup->finished, memory_order_acquire);
+        printf("Backup of generation %llu to %s: %s, %llu of %llu pages scanned, %llu copied\n",
+               (unsigned long long)backup->snapshot_generation, backup->path, backup->failed ? "failed" : (finished ? "done" : "running"),
+               (unsigned long long)atomic_load(&backup->pages_scanned), (unsigned long long)backup->snapshot_pages,
+               (unsigned long long)atomic_load(&backup->pages_copied));
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0)
+    {
+        /* .backup <path> [incremental] */
+        char *path = strtok(input_buffer->buffer + 8, " ");
+        char *mode = strtok(NULL, " ");
+        if (path == NULL || (mode != NULL && strcmp(mode, "incremental") != 0))
+        {
+            printf("Usage: .backup <path> [incremental]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (table->vacuum != NULL)
+            printf("A vacuum is running.\n");
+        else if (backup_start(table, path, mode != NULL))
+            printf("Backup started.\n");
+        return META_COMMAND_SUCCESS;
+    }
+    else
+    {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+/* --- Statement compiler ---
+   A statement is first split into tokens. Keywords and punctuation stay as
+   they are, and every other token is a parameter. The statement's shape is
+   its tokens with a ? in place of each parameter, marked with % where a like
+   pattern has one. The compiler looks only at the shape, so one program
+   serves every statement of that shape whatever its values. A statement
+   whose shape was seen before skips the compiler: it is split into tokens
+   and its values are bound to the cached program. */
+typedef struct
+{
+    sqltoken *tokens;
+    uint32_t num_tokens;
+    uint32_t position;
+    program *program;
+    uint32_t code_capacity;
+    uint32_t params_capacity;
+} sqlcompiler;
+
+/* every keyword but punctuation, by length */
+#define SQL_KEYWORD_MAX_LENGTH 8
+const char *const sql_keywords[SQL_KEYWORD_MAX_LENGTH + 1][4] = {
+    [1] = {"*", "=", "<", ">"},
+    [2] = {"<=", ">=", "id", "by"},
+    [3] = {"and", "asc"},
+    [4] = {"desc", "like"},
+    [5] = {"where", "order", "limit", "email"},
+    [6] = {"select", "insert", "values"},
+    [8] = {"username"},
+};
+const char *const id_comparison_keywords[] = {"=", ">=", ">", "<=", "<"};
+
+bool sql_token_is(sqltoken *token, const char *text)
+{
+    return token->keyword && strncmp(token->text, text, token->length) == 0 && text[token->length] == '\0';
+}
+
+bool sql_token_is_punctuation(sqltoken *token)
+{
+    return token->keyword && token->length == 1 && strchr("(),", token->text[0]) != NULL;
+}
+
+/* what a token contributes to the shape: a keyword itself, a parameter its
+   marker */
+const char *sql_token_shape(sqltoken *token, size_t *length)
+{
+    if (token->keyword)
+    {
+        *length = token->length;
+        return token->text;
+    }
+    *length = token->match == STRING_MATCH_EQUAL ? 1 : 2;
+    return token->match == STRING_MATCH_PREFIX ? "?%" : token->match == STRING_MATCH_SUFFIX ? "%?" : "?";
+}
+
+/* Tokens are separated by spaces. In a select's column list and after
+   insert values, commas and parentheses are tokens of their own too;
+   anywhere else they are part of a value, as in the username a,b. Inside
+   parentheses a value runs to the next comma or closing parenthesis, so it
+   may contain spaces. A hash of
+   the shape is worked out on the way, from each keyword's first character
+   and length and each parameter's match, so a statement seen before never has
+   its shape written out. */
+uint32_t sql_tokenize(const char *text, sqltoken **tokens, uint32_t *capacity, uint32_t *hash)
+{
+    uint32_t count = 0;
+    bool in_parentheses = false;
+    bool punctuation = false;
+    bool column_list = false;
+    *hash = 2166136261u;
+    while (true)
+    {
+        while (*text == ' ')
+            text++;
+        if (*text == '\0')
+            return count;
+        if (count == *capacity)
+        {
+            *capacity = *capacity == 0 ? 16 : *capacity * 2;
+            *tokens = realloc(*tokens, *capacity * sizeof(sqltoken));
+        }
+        sqltoken *token = &(*tokens)[count++];
+        token->text = text;
+        token->match = STRING_MATCH_EQUAL;
+        if (punctuation && (*text == '(' || *text == ')' || *text == ','))
+        {
+            if (*text != ',')
+                in_parentheses = *text == '(';
+            token->length = 1;
+            token->keyword = true;
+        }
+        else
+        {
+            token->length = strcspn(text, in_parentheses ? ",)" : punctuation ? " ,()" : " ");
+            while (in_parentheses && token->length > 0 && text[token->length - 1] == ' ')
+                token->length--;
+            token->keyword = false;
+            for (uint32_t i = 0; token->length <= SQL_KEYWORD_MAX_LENGTH && i < 4 && !token->keyword; i++)
+            {
+                const char *keyword = sql_keywords[token->length][i];
+                token->keyword = keyword != NULL && keyword[0] == text[0] && memcmp(text, keyword, token->length) == 0;
+            }
+            if (!token->keyword && token->length > 0 && text[token->length - 1] == '%')
+                token->match = STRING_MATCH_PREFIX;
+            else if (!token->keyword && token->length > 0 && text[0] == '%')
+                token->match = STRING_MATCH_SUFFIX;
+        }
+        if (count == 1)
+            column_list = punctuation = sql_token_is(token, "select");
+        else if (count == 2 && sql_token_is(&(*tokens)[0], "insert") && sql_token_is(token, "values"))
+            punctuation = true;
+        else if (column_list &&
+                 (sql_token_is(token, "where") || sql_token_is(token, "order") || sql_token_is(token, "limit")))
+            column_list = punctuation = false;
+        text += token->length;
+        uint32_t part = token->keyword ? (uint8_t)token->text[0] << 8 | token->length : token->match;
+        *hash = (*hash ^ part) * 16777619u;
+    }
+}
+
+char *sql_shape(sqltoken *tokens, uint32_t count)
+{
+    size_t length = 1;
+    for (uint32_t i = 0; i < count; i++)
+        length += (tokens[i].keyword ? tokens[i].length : 2) + 1;
+    char *shape = malloc(length);
+    char *end = shape;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i > 0)
+            *end++ = ' ';
+        const char *part = sql_token_shape(&tokens[i], &length);
+        memcpy(end, part, length);
+        end += length;
+    }
+    *end = '\0';
+    return shape;
+}
+
+bool sql_shape_matches(const char *shape, sqltoken *tokens, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i > 0 && *shape++ != ' ')
+            return false;
+        size_t length;
+        const char *part = sql_token_shape(&tokens[i], &length);
+        if (strncmp(shape, part, length) != 0)
+            return false;
+        shape += length;
+    }
+    return *shape == '\0';
+}
+
+sqltoken *compiler_peek(sqlcompiler *compiler)
+{
+    return compiler->position < compiler->num_tokens ? &compiler->tokens[compiler->position] : NULL;
+}
+
+bool compiler_accept(sqlcompiler *compiler, const char *keyword)
+{
+    sqltoken *token = compiler_peek(compiler);
+    if (token == NULL || !sql_token_is(token, keyword))
+        return false;
+    compiler->position++;
+    return true;
+}
+
+/* the next token as a column name, or 0 */
+uint8_t compiler_column(sqlcompiler *compiler)
+{
+    if (compiler_accept(compiler, "id"))
+        return COLUMN_ID;
+    if (compiler_accept(compiler, "username"))
+        return COLUMN_USERNAME;
+    if (compiler_accept(compiler, "email"))
+        return COLUMN_EMAIL;
+    return 0;
+}
+
+/* the next token as a value. Keywords are taken as values here too, as any
+   word could be a username; only punctuation is refused. */
+bool compiler_param(sqlcompiler *compiler, paramkind kind, stringmatchtype match, uint32_t *index)
+{
+    sqltoken *token = compiler_peek(compiler);
+    if (token == NULL || sql_token_is_punctuation(token))
+        return false;
+    program *program = compiler->program;
+    if (program->num_params == compiler->params_capacity)
+    {
+        compiler->params_capacity = compiler->params_capacity == 0 ? 8 : compiler->params_capacity * 2;
+        program->params = realloc(program->params, compiler->params_capacity * sizeof(programparam));
+    }
+    *index = program->num_params++;
+    program->params[*index].token = compiler->position++;
+    program->params[*index].kind = kind;
+    program->params[*index].match = match;
+    return true;
+}
+
+uint32_t compiler_emit(sqlcompiler *compiler, opcode opcode, uint8_t p1, uint32_t p2, uint32_t p3)
+{
+    program *program = compiler->program;
+    if (program->num_instructions == compiler->code_capacity)
+    {
+        compiler->code_capacity = compiler->code_capacity == 0 ? 16 : compiler->code_capacity * 2;
+        program->code = realloc(program->code, compiler->code_capacity * sizeof(instruction));
+    }
+    instruction *instruction = &program->code[program->num_instructions];
+    instruction->opcode = opcode;
+    instruction->p1 = p1;
+    instruction->p2 = p2;
+    instruction->p3 = p3;
+    return program->num_instructions++;
+}
+
+/* select [*|col[,col...]] [where <col> <op> <value> [and ...]] [order by id [asc|desc]] [limit N]
+
+   Id comparisons narrow the range the cursor seeks to. The first comparison
+   on each string column is pushed down into the scan, where it is evaluated
+   against the leaf bytes; any further one on the same column is compared in
+   the program's loop. */
+prepareresult compile_select(sqlcompiler *compiler)
+{
+    program *program = compiler->program;
+    uint8_t columns = COLUMN_ALL;
+    sqltoken *token = compiler_peek(compiler);
+    if (token != NULL && !sql_token_is(token, "where") && !sql_token_is(token, "order") &&
+        !sql_token_is(token, "limit") && !compiler_accept(compiler, "*"))
+    {
+        columns = 0;
+        do
+        {
+            uint8_t column = compiler_column(compiler);
+            if (column == 0)
+                return PREPARE_SYNTAX_ERROR;
+            columns |= column;
+        } while (compiler_accept(compiler, ","));
+    }
+
+    uint8_t filtered = 0;
+    uint8_t compared = 0;
+    if (compiler_accept(compiler, "where"))
+    {
+        do
+        {
+            uint8_t column = compiler_column(compiler);
+            sqltoken *op = compiler_peek(compiler);
+            if (column == 0 || op == NULL)
+                return PREPARE_SYNTAX_ERROR;
+            compiler->position++;
+
+            uint32_t param;
+            if (column == COLUMN_ID)
+            {
+                uint8_t comparison = 0;
+                while (comparison < 5 && !sql_token_is(op, id_comparison_keywords[comparison]))
+                    comparison++;
+                if (comparison == 5 || !compiler_param(compiler, PARAM_ID, STRING_MATCH_ANY, &param))
+                    return PREPARE_SYNTAX_ERROR;
+                compiler_emit(compiler, OP_RANGE, comparison, param, 0);
+                continue;
+            }
+
+            /* prefix ("abc%") and suffix ("%abc") patterns are supported */
+            sqltoken *value = compiler_peek(compiler);
+            stringmatchtype match = STRING_MATCH_EQUAL;
+            if (sql_token_is(op, "like") && value != NULL)
+                match = value->match;
+            if (!sql_token_is(op, "=") && match == STRING_MATCH_EQUAL)
+                return PREPARE_SYNTAX_ERROR;
+            if (!compiler_param(compiler, column == COLUMN_USERNAME ? PARAM_USERNAME : PARAM_EMAIL, match, &param))
+                return PREPARE_SYNTAX_ERROR;
+            if (filtered & column)
+            {
+                compared |= column;
+                continue;
+            }
+            filtered |= column;
+            compiler_emit(compiler, OP_FILTER, column, param, 0);
+        } while (compiler_accept(compiler, "and"));
+    }
+
+    bool descending = false;
+    if (compiler_accept(compiler, "order"))
+    {
+        if (!compiler_accept(compiler, "by") || !compiler_accept(compiler, "id"))
+            return PREPARE_SYNTAX_ERROR;
+        descending = compiler_accept(compiler, "desc");
+        if (!descending)
+            compiler_accept(compiler, "asc");
+    }
+    uint32_t limit = UINT32_MAX;
+    if (compiler_accept(compiler, "limit") && !compiler_param(compiler, PARAM_LIMIT, STRING_MATCH_ANY, &limit))
+        return PREPARE_SYNTAX_ERROR;
+    if (compiler_peek(compiler) != NULL)
+        return PREPARE_SYNTAX_ERROR;
+
+    /* the columns compared in the loop have to be read even if not returned */
+    compiler_emit(compiler, OP_OPEN, columns | compared, descending, 0);
+    uint32_t seek = compiler_emit(compiler, OP_SEEK, 0, 0, 0);
+    uint32_t loop = program->num_instructions;
+    if (limit != UINT32_MAX)
+        compiler_emit(compiler, OP_LIMIT, 0, limit, 0);
+    compiler_emit(compiler, OP_NEXT, 0, 0, 0);
+    uint8_t seen = 0;
+    for (uint32_t i = 0; i < program->num_params; i++)
+    {
+        uint8_t column = program->params[i].kind == PARAM_USERNAME ? COLUMN_USERNAME
+                         : program->params[i].kind == PARAM_EMAIL  ? COLUMN_EMAIL
+                                                                   : 0;
+        if (column == 0)
+            continue;
+        if (seen & column)
+        {
+            compiler_emit(compiler, OP_COLUMN, column, 0, 0);
+            compiler_emit(compiler, OP_COMPARE, 0, i, loop);
+            if (program->compares == NULL)
+                program->compares = malloc(program->num_params * sizeof(stringpredicate));
+        }
+        seen |= column;
+    }
+    compiler_emit(compiler, OP_EMIT, columns, 0, 0);
+    compiler_emit(compiler, OP_GOTO, 0, 0, loop);
+    uint32_t close = compiler_emit(compiler, OP_CLOSE, 0, 0, 0);
+    uint32_t halt = compiler_emit(compiler, OP_HALT, 0, 0, 0);
+
+    program->code[seek].p3 = halt;
+    for (uint32_t i = loop; i < close; i++)
+        if (program->code[i].opcode == OP_LIMIT || program->code[i].opcode == OP_NEXT)
+            program->code[i].p3 = close;
+    return PREPARE_SUCCESS;
+}
+
+/* insert id username email
+   insert values (id, username, email)[, (id, username, email) ...] */
+prepareresult compile_insert(sqlcompiler *compiler)
+{
+    uint32_t first = compiler->program->num_params;
+    uint32_t param;
+    if (!compiler_accept(compiler, "values"))
+    {
+        if (!compiler_param(compiler, PARAM_ID, STRING_MATCH_ANY, &param) ||
+            !compiler_param(compiler, PARAM_USERNAME, STRING_MATCH_ANY, &param) ||
+            !compiler_param(compiler, PARAM_EMAIL, STRING_MATCH_ANY, &param))
+            return PREPARE_SYNTAX_ERROR;
+        compiler_emit(compiler, OP_INSERT, false, first, 1);
+        compiler_emit(compiler, OP_HALT, 0, 0, 0);
+        return PREPARE_SUCCESS;
+    }
+
+    uint32_t rows = 0;
+    do
+    {
+        if (!compiler_accept(compiler, "(") || !compiler_param(compiler, PARAM_ID, STRING_MATCH_ANY, &param) ||
+            !compiler_accept(compiler, ",") ||
+            !compiler_param(compiler, PARAM_USERNAME, STRING_MATCH_ANY, &param) ||
+            !compiler_accept(compiler, ",") || !compiler_param(compiler, PARAM_EMAIL, STRING_MATCH_ANY, &param) ||
+            !compiler_accept(compiler, ")"))
+            return PREPARE_SYNTAX_ERROR;
+        rows++;
+    } while (compiler_accept(compiler, ","));
+    if (compiler_peek(compiler) != NULL)
+        return PREPARE_SYNTAX_ERROR;
+    compiler_emit(compiler, OP_INSERT, true, first, rows);
+    compiler_emit(compiler, OP_HALT, 0, 0, 0);
+    return PREPARE_SUCCESS;
+}
+
+void program_free(program *program)
+{
+    free(program->shape);
+    free(program->code);
+    free(program->params);
+    free(program->compares);
+    free(program);
+}
+
+/* on success *compiled is a new program */
+prepareresult program_compile(sqltoken *tokens, uint32_t num_tokens, uint32_t hash, program **compiled)
+{
+    sqlcompiler compiler = {tokens, num_tokens, 1, calloc(1, sizeof(program)), 0, 0};
+    program *program = compiler.program;
+    program->shape = sql_shape(tokens, num_tokens);
+    program->hash = hash;
+    program->type = sql_token_is(&tokens[0], "insert") ? STATEMENT_INSERT : STATEMENT_SELECT;
+    prepareresult result =
+        program->type == STATEMENT_INSERT ? compile_insert(&compiler) : compile_select(&compiler);
+    if (result != PREPARE_SUCCESS)
+    {
+        program_free(program);
+        return result;
+    }
+    *compiled = program;
+    return PREPARE_SUCCESS;
+}
+
+/* Checks each value against what its parameter expects, as the compiler
+   only saw the shape */
+prepareresult program_bind(program *program, sqltoken *tokens, programvalue *values)
+{
+    for (uint32_t i = 0; i < program->num_params; i++)
+    {
+        programparam *param = &program->params[i];
+        sqltoken *token = &tokens[param->token];
+        programvalue *value = &values[i];
+        value->text = token->text;
+        value->length = token->length;
+        value->match = param->match;
+        if (param->kind == PARAM_ID || param->kind == PARAM_LIMIT)
+        {
+            if (token->length > 0 && token->text[0] == '-')
+                return param->kind == PARAM_ID ? PREPARE_NEGATIVE_ID : PREPARE_SYNTAX_ERROR;
+            if (token->length == 0)
+                return PREPARE_SYNTAX_ERROR;
+            value->integer = 0;
+            for (uint32_t j = 0; j < token->length; j++)
+            {
+                uint32_t digit = token->text[j] - '0';
+                if (digit > 9 || value->integer > (UINT64_MAX - digit) / 10)
+                    return PREPARE_SYNTAX_ERROR;
+                value->integer = value->integer * 10 + digit;
+            }
+            continue;
+        }
+
+        if (value->match == STRING_MATCH_PREFIX || value->match == STRING_MATCH_SUFFIX)
+        {
+            value->text += value->match == STRING_MATCH_SUFFIX;
+            value->length--;
+        }
+        if (value->length > (param->kind == PARAM_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE))
+            return PREPARE_STRING_TOO_LONG;
+    }
+    return PREPARE_SUCCESS;
+}
+
+programcache *program_cache_open()
+{
+    return calloc(1, sizeof(programcache));
+}
+
+program *program_cache_find(programcache *cache, sqltoken *tokens, uint32_t num_tokens, uint32_t hash)
+{
+    for (uint32_t i = 0; i < cache->count; i++)
+        if (cache->programs[i]->hash == hash && sql_shape_matches(cache->programs[i]->shape, tokens, num_tokens))
+            return cache->programs[i];
+    return NULL;
+}
+
+void program_cache_add(programcache *cache, program *program)
+{
+    if (cache->count < PROGRAM_CACHE_SIZE)
+    {
+        cache->programs[cache->count++] = program;
+        return;
+    }
+    uint32_t oldest = 0;
+    for (uint32_t i = 1; i < cache->count; i++)
+        if (cache->programs[i]->last_used < cache->programs[oldest]->last_used)
+            oldest = i;
+    program_free(cache->programs[oldest]);
+    cache->programs[oldest] = program;
+}
+
+prepareresult prepare_statement(inputbuffer *input_buffer, statement *statement, programcache *programs)
+{
+    statement->explain = strncmp(input_buffer->buffer, "explain analyze ", 16) == 0;
+    statement->list_program = !statement->explain && strncmp(input_buffer->buffer, "explain ", 8) == 0;
+    size_t prefix = statement->explain ? 16 : statement->list_program ? 8 : 0;
+    statement->program = NULL;
+    statement->values = NULL;
+    statement->rows_to_insert = NULL;
+
+    uint32_t hash;
+    uint32_t num_tokens =
+        sql_tokenize(input_buffer->buffer + prefix, &programs->tokens, &programs->token_capacity, &hash);
+    sqltoken *tokens = programs->tokens;
+    if (num_tokens == 0 || (!sql_token_is(&tokens[0], "insert") && !sql_token_is(&tokens[0], "select")))
+        return PREPARE_URECOGNISED_STATEMENT;
+
+    program *program = program_cache_find(programs, tokens, num_tokens, hash);
+    if (program != NULL)
+    {
+        programs->hits++;
+    }
+    else
+    {
+        prepareresult result = program_compile(tokens, num_tokens, hash, &program);
+        if (result != PREPARE_SUCCESS)
+            return result;
+        programs->compiles++;
+        program_cache_add(programs, program);
+    }
+
+    program->uses++;
+    program->last_used = ++programs->clock;
+    if (program->num_params > programs->value_capacity)
+    {
+        programs->value_capacity = program->num_params;
+        programs->values = realloc(programs->values, program->num_params * sizeof(programvalue));
+    }
+    statement->program = program;
+    statement->type = program->type;
+    statement->values = programs->values;
+    return program_bind(program, tokens, statement->values);
+}
+
+void print_program(programcache *cache, program *program)
+{
+    const char *const names[] = {"Halt", "Range", "Filter", "Open",  "Seek", "Next",  "Column",
+                                 "Compare", "Limit", "Emit", "Goto", "Close", "Insert"};
+    printf("Program for '%s' (%" PRIu64 " uses):\n", program->shape, program->uses);
+    printf("  addr  opcode      p1      p2      p3\n");
+    for (uint32_t i = 0; i < program->num_instructions; i++)
+    {
+        instruction *instruction = &program->code[i];
+        printf("  %4u  %-8s %5u %7u %7u\n", i, names[instruction->opcode], instruction->p1, instruction->p2,
+               instruction->p3);
+    }
+    printf("Program cache: %u programs, %" PRIu64 " hits, %" PRIu64 " compiles\n", cache->count, cache->hits,
+           cache->compiles);
+}
+
+executeresult execute_insert(statement *statement, table *table)
+{
+    if (statement->rows_to_insert != NULL)
+        table_forget_rows(table, statement->rows_to_insert, statement->num_rows_to_insert);
+    else
+        table_forget_rows(table, &statement->row_to_insert, 1);
+    if (table->num_shards > 0)
+    {
+        if (statement->rows_to_insert != NULL)
+            return sharded_insert_rows(table, statement->rows_to_insert, statement->num_rows_to_insert);
+        table = table->shards[shard_for_key(table, statement->row_to_insert.id)].table;
+        pager_unpin_all(table->pager);
+    }
+    if (statement->rows_to_insert != NULL)
+    {
+        executeresult result = table_insert_rows(table, statement->rows_to_insert, statement->num_rows_to_insert);
+        if (result == EXECUTE_SUCCESS)
+            vacuum_note_rows(table, statement->rows_to_insert, statement->num_rows_to_insert);
+        return result;
+    }
+
+    row *row_to_insert = &statement->row_to_insert;
+    executeresult result = table_insert_row(table, row_to_insert);
+    if (result == EXECUTE_SUCCESS)
+        vacuum_note_rows(table, row_to_insert, 1);
+    return result;
+}
+
+/* --- Virtual machine --- */
+/* turn every comparison into an inclusive [min, max] range */
+void id_range_narrow(scanpredicate *predicate, idcomparison comparison, uint64_t id)
+{
+    uint64_t min = 0;
+    uint64_t max = UINT64_MAX;
+    bool empty = false;
+    if (comparison == ID_EQUAL)
+        min = max = id;
+    else if (comparison == ID_AT_LEAST)
+        min = id;
+    else if (comparison == ID_GREATER)
+        empty = id == UINT64_MAX, min = id + 1;
+    else if (comparison == ID_AT_MOST)
+        max = id;
+    else
+        empty = id == 0, max = id - 1;
+
+    if (min > predicate->id_min)
+        predicate->id_min = min;
+    if (max < predicate->id_max)
+        predicate->id_max = max;
+    if (empty)
+    {
+        predicate->id_min = 1;
+        predicate->id_max = 0;
+    }
+}
+
+void string_predicate_bind(stringpredicate *predicate, programvalue *value)
+{
+    predicate->type = value->match;
+    predicate->length = value->length;
+    memcpy(predicate->value, value->text, value->length);
+    predicate->value[value->length] = '\0';
+}
+
+void program_row(programvalue *values, row *destination)
+{
+    memset(destination, 0, sizeof(*destination));
+    destination->id = values[0].integer;
+    memcpy(destination->username, values[1].text, values[1].length);
+    memcpy(destination->email, values[2].text, values[2].length);
+}
+
+/* Runs a bound statement. Under explain analyze a select counts its rows
+   instead of printing them, and always walks the tree. rows, if not NULL,
+   gets how many rows were returned or inserted. */
+executeresult program_run(statement *statement, table *table, uint64_t *rows)
+{
+    program *program = statement->program;
+    programvalue *values = statement->values;
+    scanpredicate predicate;
+    memset(&predicate, 0, sizeof(predicate));
+    predicate.id_max = UINT64_MAX;
+    predicate.columns = COLUMN_ALL;
+
+    mergescan scan;
+    bool scanning = false;
+    bool from_cache = false; /* a single id answered by the row cache */
+    bool cached_row = false; /* and its row is still to be stepped to */
+    row row;
+    const char *column = NULL;
+    uint64_t count = 0;
+    executeresult result = EXECUTE_SUCCESS;
+
+    /* the loop only matches rows against these */
+    for (uint32_t i = 0; program->compares != NULL && i < program->num_instructions; i++)
+    {
+        if (program->code[i].opcode == OP_COMPARE)
+            string_predicate_bind(&program->compares[program->code[i].p2], &values[program->code[i].p2]);
+    }
+
+    uint32_t pc = 0;
+    while (true)
+    {
+        instruction *op = &program->code[pc++];
+        switch (op->opcode)
+        {
+        case OP_HALT:
+            if (rows != NULL)
+                *rows = count;
+            return result;
+        case OP_RANGE:
+            id_range_narrow(&predicate, op->p1, values[op->p2].integer);
+            break;
+        case OP_FILTER:
+            string_predicate_bind(op->p1 == COLUMN_USERNAME ? &predicate.username : &predicate.email,
+                                  &values[op->p2]);
+            break;
+        case OP_OPEN:
+            predicate.columns = op->p1;
+            predicate.descending = op->p2;
+            break;
+        case OP_SEEK:
+            if (predicate.id_min > predicate.id_max)
+            {
+                pc = op->p3;
+            }
+            else if (predicate.id_min == predicate.id_max && table->options.row_cache_rows > 0 &&
+                     !statement->explain)
+            {
+                from_cache = true;
+                cached_row = table_lookup(table, predicate.id_min, &row) &&
+                             string_predicate_matches(&predicate.username, row.username) &&
+                             string_predicate_matches(&predicate.email, row.email);
+            }
+            else
+            {
+                merge_scan_open(&scan, table, &predicate);
+                scanning = true;
+            }
+            break;
+        case OP_NEXT:
+            if (from_cache ? !cached_row : !merge_scan_next(&scan, &row))
+                pc = op->p3;
+            cached_row = false;
+            break;
+        case OP_COLUMN:
+            column = op->p1 == COLUMN_USERNAME ? row.username : row.email;
+            break;
+        case OP_COMPARE:
+            if (!string_predicate_matches(&program->compares[op->p2], column))
+                pc = op->p3;
+            break;
+        case OP_LIMIT:
+            if (count >= values[op->p2].integer)
+                pc = op->p3;
+            break;
+        case OP_EMIT:
+            count++;
+            if (!statement->explain)
+                print_projected_row(&row, op->p1);
+            break;
+        case OP_GOTO:
+            pc = op->p3;
+            break;
+        case OP_CLOSE:
+            if (scanning)
+                merge_scan_close(&scan);
+            scanning = false;
+            break;
+        case OP_INSERT:
+            statement->num_rows_to_insert = op->p3;
+            if (op->p1)
+                statement->rows_to_insert = malloc(op->p3 * sizeof(row));
+            for (uint32_t i = 0; i < op->p3; i++)
+                program_row(&values[op->p2 + 3 * i], op->p1 ? &statement->rows_to_insert[i] : &statement->row_to_insert);
+            result = execute_insert(statement, table);
+            if (result == EXECUTE_SUCCESS)
+                count = op->p3;
+            break;
+        }
+    }
+}
+
+executeresult execute_statement(statement *statement, table *table)
+{
+    if (table->pager != NULL)
+        pager_unpin_all(table->pager);
+    if (statement->program != NULL)
+        return program_run(statement, table, NULL);
+    switch (statement->type)
+    {
+    case STATEMENT_INSERT:
+        return execute_insert(statement, table);
+    default:
+        return EXECUTE_SUCCESS;
+    }
+}
+
+/* --- Explain analyze --- */
+double clock_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* a root-to-leaf descent that began at started has reached the cursor */
+void trace_descent(statementtrace *trace, cursor *cursor, double started)
+{
+    trace->descents++;
+    trace->depth = cursor->depth;
+    memcpy(trace->path, cursor->path, cursor->depth * sizeof(uint64_t));
+    memcpy(trace->path_child, cursor->path_child, cursor->depth * sizeof(uint32_t));
+    trace->leaf_page_num = cursor->page_num;
+    trace->leaf_cell = cursor->cell_num;
+    trace->descend_seconds += clock_seconds() - started;
+}
+
+void print_trace(statementtrace *trace)
+{
+    printf("  Descents: %" PRIu64, trace->descents);
+    if (trace->descents > 0)
+    {
+        printf(", last:");
+        for (uint32_t i = 0; i < trace->depth; i++)
+            printf(" page %" PRIu64 " child %u >", trace->path[i], trace->path_child[i]);
+        printf(" leaf %" PRIu64 " cell %u", trace->leaf_page_num, trace->leaf_cell);
+    }
+    printf("\n");
+    printf("  Pages: %" PRIu64 " cache hits, %" PRIu64 " read from disk, %" PRIu64 " new, %" PRIu64
+           " prefetched (%" PRIu64 " waited for)\n",
+           trace->cache_hits, trace->disk_reads, trace->new_pages, trace->pages_prefetched, trace->readahead_waits);
+    if (trace->shared_hits > 0)
+        printf("  Shared cache: %" PRIu64 " pages copied instead of read\n", trace->shared_hits);
+    printf("  Leaves walked: %" PRIu64 ", rows examined: %" PRIu64 "\n", trace->leaves_walked, trace->rows_examined);
+    printf("  Splits: %" PRIu64 " leaf, %" PRIu64 " internal, %" PRIu64 " new root\n", trace->leaf_splits,
+           trace->internal_splits, trace->new_roots);
+}
+
+/* Run the statement with a trace attached to each tree it can touch, then
+   report what it did in place of its rows. Shards are traced separately
+   since their writer threads run at the same time. */
+executeresult explain_statement(statement *statement, table *table, double parse_seconds)
+{
+    uint32_t num_trees = table->num_shards > 0 ? table->num_shards : 1;
+    statementtrace *traces = calloc(num_trees, sizeof(statementtrace));
+    for (uint32_t i = 0; i < num_trees; i++)
+    {
+        pager *pager = table->num_shards > 0 ? table->shards[i].table->pager : table->pager;
+        pager_unpin_all(pager);
+        pager->trace = &traces[i];
+    }
+
+    double started = clock_seconds();
+    executeresult result = EXECUTE_SUCCESS;
+    uint64_t rows = 0;
+    result = program_run(statement, table, &rows);
+    double elapsed = clock_seconds() - started;
+
+    bool is_select = statement->type == STATEMENT_SELECT;
+    double descend_seconds = 0, split_seconds = 0;
+    printf("Explain analyze %s: %" PRIu64 " rows %s\n", is_select ? "select" : "insert", rows,
+           is_select ? "returned" : "inserted");
+    for (uint32_t i = 0; i < num_trees; i++)
+    {
+        if (table->num_shards > 0)
+        {
+            table->shards[i].table->pager->trace = NULL;
+            if (traces[i].descents == 0)
+                continue; /* the statement had nothing for this shard */
+            printf(" Shard %u:\n", i);
+        }
+        else
+        {
+            table->pager->trace = NULL;
+        }
+        print_trace(&traces[i]);
+        descend_seconds += traces[i].descend_seconds;
+        split_seconds += traces[i].split_seconds;
+    }
+    /* shard times are summed, so with several shards they can add up to more than the total */
+    double rest_seconds = elapsed - descend_seconds - split_seconds;
+    printf("  Time: parse %.3f ms, descend %.3f ms, split %.3f ms, %s %.3f ms, total %.3f ms\n",
+           parse_seconds * 1e3, descend_seconds * 1e3, split_seconds * 1e3, is_select ? "scan" : "insert",
+           (rest_seconds > 0 ? rest_seconds : 0) * 1e3, (parse_seconds + elapsed) * 1e3);
+    free(traces);
+    return result;
+}
+
+/* --- Server ---
+   Binary protocol, host byte order, for local clients only. Every frame is
+   a uint32 length of what follows, then a one-byte type:
+     insert  u8 1, u64 id, u8 username length, u8 email length, both strings
+     select  u8 2, u64 id_min, u64 id_max, u32 limit
+   and every response
+     u8 status (responsestatus), then for select u32 count and that many
+     rows of u64 id, u8 username length, u8 email length, both strings.
+   Clients may pipeline any number of frames. Responses come back in request
+   order, and an insert is acknowledged only once it is on disk. */
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_FRAME (1 << 20)
+#define SERVER_READ_SIZE 65536
+
+typedef enum
+{
+    REQUEST_INSERT = 1,
+    REQUEST_SELECT = 2
+} requesttype;
+
+typedef enum
+{
+    RESPONSE_OK = 0,
+    RESPONSE_DUPLICATE_KEY = 1,
+    RESPONSE_BAD_REQUEST = 2,
+    RESPONSE_FAILED = 3 /* the insert was valid but not done */
+} responsestatus;
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} bytebuffer;
+
+typedef struct
+{
+    int file_descriptor;
+    bool listener;
+    bool peer_closed; /* no more requests, but responses are still owed */
+    bool closing;
+    uint32_t events; /* what epoll watches for */
+    bytebuffer input;
+    bytebuffer output;
+    size_t output_sent;
+} connection;
+
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int signal_number)
+{
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+void bytebuffer_reserve(bytebuffer *buffer, size_t extra)
+{
+    if (buffer->length + extra <= buffer->capacity)
+        return;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra)
+        capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+}
+
+void bytebuffer_append(bytebuffer *buffer, const void *data, size_t length)
+{
+    bytebuffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/* appends a row as the protocol encodes it */
+void bytebuffer_append_row(bytebuffer *buffer, row *row)
+{
+    uint8_t username_length = (uint8_t)strnlen(row->username, COLUMN_USERNAME_SIZE);
+    uint8_t email_length = (uint8_t)strnlen(row->email, COLUMN_EMAIL_SIZE);
+    bytebuffer_append(buffer, &row->id, sizeof(row->id));
+    bytebuffer_append(buffer, &username_length, 1);
+    bytebuffer_append(buffer, &email_length, 1);
+    bytebuffer_append(buffer, row->username, username_length);
+    bytebuffer_append(buffer, row->email, email_length);
+}
+
+connection *connection_open(int fd, bool listener)
+{
+    connection *connection = calloc(1, sizeof(*connection));
+    connection->file_descriptor = fd;
+    connection->listener = listener;
+    connection->events = EPOLLIN;
+    return connection;
+}
+
+void connection_close(int epoll_fd, connection *connection)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->file_descriptor, NULL);
+    close(connection->file_descriptor);
+    free(connection->input.data);
+    free(connection->output.data);
+    free(connection);
+}
+
+/* Decode and run one request, appending its response. Returns whether it
+   wrote to the table. */
+bool server_execute(table *table, const char *request, uint32_t length, bytebuffer *output)
+{
+    uint32_t response_length_offset = (uint32_t)output->length;
+    uint32_t response_length = 0;
+    bytebuffer_append(output, &response_length, sizeof(response_length));
+    uint8_t status = RESPONSE_BAD_REQUEST;
+    bool wrote = false;
+    table_shared_begin(table, length >= 1 && request[0] == REQUEST_INSERT);
+
+    if (length >= 1 + 8 + 2 && request[0] == REQUEST_INSERT)
+    {
+        statement statement;
+        statement.type = STATEMENT_INSERT;
+        statement.rows_to_insert = NULL;
+        statement.program = NULL;
+        memset(&statement.row_to_insert, 0, sizeof(statement.row_to_insert));
+        memcpy(&statement.row_to_insert.id, request + 1, 8);
+        uint8_t username_length = (uint8_t)request[9];
+        uint8_t email_length = (uint8_t)request[10];
+        if (length == 11u + username_length + email_length && username_length <= COLUMN_USERNAME_SIZE)
+        {
+            memcpy(statement.row_to_insert.username, request + 11, username_length);
+            memcpy(statement.row_to_insert.email, request + 11 + username_length, email_length);
+            executeresult result = execute_statement(&statement, table);
+            status = result == EXECUTE_SUCCESS              ? RESPONSE_OK
+                     : result == EXECUTE_DUPLICATE_KEY      ? RESPONSE_DUPLICATE_KEY
+                     : result == EXECUTE_EMAIL_NOT_STORABLE ? RESPONSE_BAD_REQUEST
+                                                            : RESPONSE_FAILED;
+            wrote = result == EXECUTE_SUCCESS;
+        }
+        bytebuffer_append(output, &status, 1);
+    }
+    else if (length == 1 + 8 + 8 + 4 && request[0] == REQUEST_SELECT)
+    {
+        scanpredicate predicate;
+        memset(&predicate, 0, sizeof(predicate));
+        memcpy(&predicate.id_min, request + 1, 8);
+        memcpy(&predicate.id_max, request + 9, 8);
+        uint32_t limit;
+        memcpy(&limit, request + 17, 4);
+        predicate.columns = COLUMN_ALL;
+
+        status = RESPONSE_OK;
+        bytebuffer_append(output, &status, 1);
+        uint32_t count_offset = (uint32_t)output->length;
+        uint32_t count = 0;
+        bytebuffer_append(output, &count, sizeof(count));
+
+        if (predicate.id_min == predicate.id_max && table->options.row_cache_rows > 0)
+        {
+            row row;
+            if (limit > 0 && table_lookup(table, predicate.id_min, &row))
+            {
+                bytebuffer_append_row(output, &row);
+                count++;
+            }
+        }
+        else if (predicate.id_min <= predicate.id_max)
+        {
+            mergescan scan;
+            row row;
+            merge_scan_open(&scan, table, &predicate);
+            while (count < limit && merge_scan_next(&scan, &row))
+            {
+                bytebuffer_append_row(output, &row);
+                count++;
+            }
+            merge_scan_close(&scan);
+        }
+        memcpy(output->data + count_offset, &count, sizeof(count));
+    }
+    else
+    {
+        bytebuffer_append(output, &status, 1);
+    }
+
+    table_shared_end(table);
+    response_length = (uint32_t)(output->length - response_length_offset - sizeof(response_length));
+    memcpy(output->data + response_length_offset, &response_length, sizeof(response_length));
+    return wrote;
+}
+
+/* Read everything the client has sent and run each complete frame.
+   Returns whether any request wrote to the table. */
+bool connection_read(table *table, connection *connection)
+{
+    while (true)
+    {
+        bytebuffer_reserve(&connection->input, SERVER_READ_SIZE);
+        ssize_t bytes_read = read(connection->file_descriptor, connection->input.data + connection->input.length,
+                                  connection->input.capacity - connection->input.length);
+        if (bytes_read > 0)
+        {
+            connection->input.length += bytes_read;
+            continue;
+        }
+        if (bytes_read == 0)
+            connection->peer_closed = true;
+        else if (errno != EAGAIN && errno != EINTR)
+            connection->closing = true;
+        if (bytes_read == 0 || errno != EINTR)
+            break;
+    }
+
+    bool wrote = false;
+    size_t offset = 0;
+    while (connection->input.length - offset >= sizeof(uint32_t))
+    {
+        uint32_t length;
+        memcpy(&length, connection->input.data + offset, sizeof(length));
+        if (length == 0 || length > SERVER_MAX_FRAME)
+        {
+            connection->closing = true;
+            break;
+        }
+        if (connection->input.length - offset - sizeof(length) < length)
+            break;
+        wrote |= server_execute(table, connection->input.data + offset + sizeof(length), length, &connection->output);
+        offset += sizeof(length) + length;
+    }
+    memmove(connection->input.data, connection->input.data + offset, connection->input.length - offset);
+    connection->input.length -= offset;
+    return wrote;
+}
+
+/* send what the socket takes now and watch for EPOLLOUT if anything is left */
+void connection_write(int epoll_fd, connection *connection)
+{
+    while (connection->output_sent < connection->output.length)
+    {
+        ssize_t bytes_written = write(connection->file_descriptor, connection->output.data + connection->output_sent,
+                                      connection->output.length - connection->output_sent);
+        if (bytes_written > 0)
+        {
+            connection->output_sent += bytes_written;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            connection->closing = true;
+        break;
+    }
+    if (connection->output_sent == connection->output.length)
+    {
+        connection->output.length = 0;
+        connection->output_sent = 0;
+    }
+
+    if (connection->peer_closed && connection->output.length == 0)
+        connection->closing = true;
+    if (connection->closing)
+        return;
+
+    uint32_t events = (connection->peer_closed ? 0 : EPOLLIN) | (connection->output.length > 0 ? EPOLLOUT : 0);
+    if (events != connection->events)
+    {
+        struct epoll_event event = {.events = events, .data.ptr = connection};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->file_descriptor, &event);
+        connection->events = events;
+    }
+}
+
+int server_listen_unix(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1)
+        return -1;
+    return fd;
+}
 
-    update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+/* loopback only: the protocol has no authentication */
+int server_listen_tcp(uint16_t port)
+{
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1)
+        return -1;
+    return fd;
+}
 
-    if (!splitting_root)
+void server_add(int epoll_fd, connection *connection)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->file_descriptor, &event) == -1)
     {
-        internal_node_insert(table, *node_parent(old_node), new_page_num);
-        *node_parent(new_node) = *node_parent(old_node);
+        printf("epoll_ctl failed: %d\n", errno);
+        exit(EXIT_FAILURE);
     }
 }
 
-/* --- leaf insert (regular) --- */
-void leaf_node_insert(cursor *cursor, uint32_t key, row *value)
+/* Serve until SIGINT or SIGTERM. Each epoll round runs every request that
+   arrived, commits all of their writes with one flush and fdatasync, and
+   only then sends the responses. */
+void server_run(table *table, const char *socket_path, int tcp_port)
 {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    if (num_cells >= LEAF_NODE_MAX_CELLS)
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action = {.sa_handler = server_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    connection *listeners[2];
+    uint32_t num_listeners = 0;
+    if (socket_path != NULL)
     {
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+        int fd = server_listen_unix(socket_path);
+        if (fd == -1)
+        {
+            printf("Unable to listen on %s\n", socket_path);
+            exit(EXIT_FAILURE);
+        }
+        listeners[num_listeners] = connection_open(fd, true);
+        server_add(epoll_fd, listeners[num_listeners++]);
+        printf("Listening on %s\n", socket_path);
+    }
+    if (tcp_port > 0)
+    {
+        int fd = server_listen_tcp((uint16_t)tcp_port);
+        if (fd == -1)
+        {
+            printf("Unable to listen on 127.0.0.1:%d\n", tcp_port);
+            exit(EXIT_FAILURE);
+        }
+        listeners[num_listeners] = connection_open(fd, true);
+        server_add(epoll_fd, listeners[num_listeners++]);
+        printf("Listening on 127.0.0.1:%d\n", tcp_port);
     }
+    fflush(stdout);
 
-    if (cursor->cell_num < num_cells)
+    connection **connections = NULL;
+    uint32_t num_connections = 0;
+    uint32_t connections_capacity = 0;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    while (!server_stopping)
     {
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+        int ready = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (ready == -1)
+            continue; /* EINTR, the loop condition decides */
+
+        bool wrote = false;
+        for (int i = 0; i < ready; i++)
         {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+            connection *connection = events[i].data.ptr;
+            if (connection->listener)
+            {
+                int fd;
+                while ((fd = accept4(connection->file_descriptor, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                {
+                    if (num_connections == connections_capacity)
+                    {
+                        connections_capacity = connections_capacity ? connections_capacity * 2 : 16;
+                        connections = realloc(connections, connections_capacity * sizeof(*connections));
+                    }
+                    connections[num_connections] = connection_open(fd, false);
+                    server_add(epoll_fd, connections[num_connections]);
+                    num_connections++;
+                }
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !connection->peer_closed)
+                wrote |= connection_read(table, connection);
+        }
+
+        if (wrote)
+            db_sync(table);
+
+        for (uint32_t i = 0; i < num_connections;)
+        {
+            connection *connection = connections[i];
+            if (!connection->closing)
+                connection_write(epoll_fd, connection);
+            if (connection->closing)
+            {
+                connection_close(epoll_fd, connection);
+                connections[i] = connections[--num_connections];
+                continue;
+            }
+            i++;
         }
     }
 
-    (*leaf_node_num_cells(node)) += 1;
-    *leaf_node_key(node, cursor->cell_num) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    for (uint32_t i = 0; i < num_connections; i++)
+        connection_close(epoll_fd, connections[i]);
+    free(connections);
+    for (uint32_t i = 0; i < num_listeners; i++)
+        connection_close(epoll_fd, listeners[i]);
+    close(epoll_fd);
+    if (socket_path != NULL)
+        unlink(socket_path);
 }
 
-/* --- pager flush / close --- */
-void pager_flush(pager *pager, uint32_t page_num)
+/* --- Load generator ---
+   Drives a server with inserts from several connections, each keeping up to
+   `pipeline` requests in flight, then reads every row back with selects. */
+int loadgen_connect(const char *target)
 {
-    if (pager->pages[page_num] == NULL)
+    char *end;
+    long port = strtol(target, &end, 10);
+    if (*end == '\0')
     {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+        struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons((uint16_t)port)};
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+        return -1;
     }
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1)
-    {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", target);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+        return fd;
+    return -1;
+}
 
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1)
+bool loadgen_read_exact(int fd, void *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
     {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+        ssize_t bytes_read = read(fd, (char *)buffer + done, length - done);
+        if (bytes_read <= 0)
+            return false;
+        done += bytes_read;
     }
+    return true;
 }
 
-void db_close(table *table)
+/* reads one response; returns its status, with the payload in buffer */
+int loadgen_read_response(int fd, bytebuffer *buffer)
 {
-    pager *pager = table->pager;
+    uint32_t length;
+    if (!loadgen_read_exact(fd, &length, sizeof(length)) || length == 0)
+        return -1;
+    buffer->length = 0;
+    bytebuffer_reserve(buffer, length);
+    if (!loadgen_read_exact(fd, buffer->data, length))
+        return -1;
+    buffer->length = length;
+    return (uint8_t)buffer->data[0];
+}
 
-    for (uint32_t i = 0; i < pager->num_pages; i++)
+void loadgen_run(const char *target, uint32_t clients, uint32_t requests, uint32_t pipeline)
+{
+    int *fds = malloc(clients * sizeof(int));
+    for (uint32_t c = 0; c < clients; c++)
     {
-        if (pager->pages[i] == NULL)
-            continue;
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        fds[c] = loadgen_connect(target);
+        if (fds[c] == -1)
+        {
+            printf("Unable to connect to %s\n", target);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    int result = close(pager->file_descriptor);
-    if (result == -1)
+    /* start from the wall clock so later runs do not collide with earlier ones */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t base_id = ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000) << 12;
+    bytebuffer request = {0};
+    bytebuffer response = {0};
+    uint64_t inserted = 0, duplicates = 0, errors = 0;
+
+    double start = clock_seconds();
+    for (uint32_t sent = 0; sent < requests; sent += pipeline)
     {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+        uint32_t batch = requests - sent < pipeline ? requests - sent : pipeline;
+        for (uint32_t c = 0; c < clients; c++)
+        {
+            request.length = 0;
+            for (uint32_t i = 0; i < batch; i++)
+            {
+                row row = {0};
+                row.id = base_id + (uint64_t)c * requests + sent + i;
+                snprintf(row.username, sizeof(row.username), "user%" PRIu64, row.id % 100000);
+                snprintf(row.email, sizeof(row.email), "user%" PRIu64 "@example.com", row.id);
+                uint32_t length = (uint32_t)(1 + 8 + 2 + strlen(row.username) + strlen(row.email));
+                uint8_t type = REQUEST_INSERT;
+                bytebuffer_append(&request, &length, sizeof(length));
+                bytebuffer_append(&request, &type, 1);
+                bytebuffer_append_row(&request, &row);
+            }
+            if (write(fds[c], request.data, request.length) != (ssize_t)request.length)
+            {
+                printf("Write to server failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (uint32_t c = 0; c < clients; c++)
+        {
+            for (uint32_t i = 0; i < batch; i++)
+            {
+                int status = loadgen_read_response(fds[c], &response);
+                if (status == RESPONSE_OK)
+                    inserted++;
+                else if (status == RESPONSE_DUPLICATE_KEY)
+                    duplicates++;
+                else if (status == -1)
+                {
+                    printf("Server closed the connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                else
+                    errors++;
+            }
+        }
+    }
+    double elapsed = clock_seconds() - start;
+    printf("%" PRIu64 " inserts from %u clients, pipeline %u: %.3f s, %.0f inserts/s (%" PRIu64
+           " duplicates, %" PRIu64 " errors)\n",
+           inserted, clients, pipeline, elapsed, inserted / elapsed, duplicates, errors);
+
+    /* every client reads its own range back */
+    uint64_t rows_read = 0;
+    start = clock_seconds();
+    for (uint32_t c = 0; c < clients; c++)
+    {
+        uint64_t id_min = base_id + (uint64_t)c * requests;
+        uint64_t id_max = id_min + requests - 1;
+        uint32_t limit = UINT32_MAX;
+        uint32_t length = 1 + 8 + 8 + 4;
+        uint8_t type = REQUEST_SELECT;
+        request.length = 0;
+        bytebuffer_append(&request, &length, sizeof(length));
+        bytebuffer_append(&request, &type, 1);
+        bytebuffer_append(&request, &id_min, 8);
+        bytebuffer_append(&request, &id_max, 8);
+        bytebuffer_append(&request, &limit, 4);
+        if (write(fds[c], request.data, request.length) != (ssize_t)request.length ||
+            loadgen_read_response(fds[c], &response) != RESPONSE_OK)
+        {
+            printf("Select failed\n");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t count;
+        memcpy(&count, response.data + 1, sizeof(count));
+        rows_read += count;
     }
+    printf("%" PRIu64 " rows read back in %.3f s\n", rows_read, clock_seconds() - start);
 
-    free(pager);
-    free(table);
+    for (uint32_t c = 0; c < clients; c++)
+        close(fds[c]);
+    free(fds);
+    free(request.data);
+    free(response.data);
 }
 
-/* --- input buffer --- */
-inputbuffer *new_input_buffer()
-{
-    inputbuffer *input_buffer = malloc(sizeof(inputbuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
-    return input_buffer;
-}
+/* --- Concurrent writer stress test --- */
+/* --stress FILE inserts --rows random ids into a fresh FILE from 1, 2, 4 ...
+   32 threads at once through table_insert_row, then has every thread insert
+   part of another thread's ids again, which must all be duplicates. The tree
+   is checked after each run and again after reopening the file. */
+#define STRESS_MAX_THREADS 32
 
-void print_prompt()
+typedef struct
 {
-    printf("Sup boy>");
-    fflush(stdout);
-}
-
-void read_input(inputbuffer *input_buffer)
+    table *table;
+    pthread_barrier_t *barrier;
+    uint32_t thread;
+    uint32_t num_threads;
+    uint64_t num_rows;
+    uint64_t inserted;
+    uint64_t duplicates;
+    uint64_t errors;
+} stressworker;
+
+/* a bijection, so the ids are distinct, and scattered over the whole tree */
+uint64_t stress_id(uint64_t i)
 {
-    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-    if (bytes_read <= 0)
-    {
-        printf("Error reading Input\n");
-        exit(EXIT_FAILURE);
-    }
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+    uint64_t x = i + 1;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
 }
 
-void close_input_buffer(inputbuffer *input_buffer)
+void stress_insert(stressworker *worker, uint64_t i)
 {
-    free(input_buffer->buffer);
-    free(input_buffer);
+    row row = {0};
+    row.id = stress_id(i);
+    snprintf(row.username, sizeof(row.username), "user%" PRIu64, i);
+    snprintf(row.email, sizeof(row.email), "user%" PRIu64 "@example.com", i);
+    executeresult result = table_insert_row(worker->table, &row);
+    if (result == EXECUTE_SUCCESS)
+        worker->inserted++;
+    else if (result == EXECUTE_DUPLICATE_KEY)
+        worker->duplicates++;
+    else
+        worker->errors++;
 }
 
-/* --- printing / tree debug --- */
-void indent(uint32_t level)
+void *stress_writer(void *argument)
 {
-    for (uint32_t i = 0; i < level; i++)
-    {
-        printf("  ");
-    }
+    stressworker *worker = argument;
+    for (uint64_t i = worker->thread; i < worker->num_rows; i += worker->num_threads)
+        stress_insert(worker, i);
+
+    /* every id is in by now: retry a tenth of the next thread's */
+    pthread_barrier_wait(worker->barrier);
+    uint32_t other = (worker->thread + 1) % worker->num_threads;
+    for (uint64_t i = other; i < worker->num_rows; i += 10 * (uint64_t)worker->num_threads)
+        stress_insert(worker, i);
+    return NULL;
 }
 
-void print_tree(pager *pager, uint32_t page_num, uint32_t indentation_level)
+typedef struct
 {
-    void *node = get_page(pager, page_num);
-    uint32_t num_keys, child;
-
-    switch (get_node_type(node))
+    pager *pager;
+    uint32_t leaf_depth; /* 0 until the first leaf */
+    uint64_t rows;
+    uint64_t *leaves; /* in key order */
+    uint64_t num_leaves, leaves_capacity;
+    const char *error;
+    uint64_t error_page_num;
+} treecheck;
+
+/* Keys in the subtree at page_num must ascend, be above low and at most high.
+   When the parent has a separator for it (has_high), the largest key must be
+   exactly that separator. Every leaf must be at the same depth. */
+void tree_check_node(treecheck *check, uint64_t page_num, uint32_t depth, bool has_low, uint64_t low, bool has_high,
+                     uint64_t high)
+{
+    void *node = get_page(check->pager, page_num);
+    const char *error = NULL;
+    if (get_node_type(node) == NODE_LEAF)
     {
-    case (NODE_LEAF):
-        num_keys = *leaf_node_num_cells(node);
-        indent(indentation_level);
-        printf("- leaf (size %d)\n", num_keys);
-        for (uint32_t i = 0; i < num_keys; i++)
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (check->leaf_depth == 0)
+            check->leaf_depth = depth + 1;
+        if (depth + 1 != check->leaf_depth)
+            error = "leaf at the wrong depth";
+        else if (num_cells == 0 && depth > 0)
+            error = "empty leaf";
+        else if (num_cells > leaf_node_max_cells(node))
+            error = "too many cells";
+        for (uint32_t i = 0; error == NULL && i < num_cells; i++)
         {
-            indent(indentation_level + 1);
-            printf("- %d\n", *leaf_node_key(node, i));
+            uint64_t key = *leaf_node_key(node, i);
+            if ((i > 0 && key <= *leaf_node_key(node, i - 1)) || (i == 0 && has_low && key <= low) ||
+                (has_high && key > high))
+                error = "key out of order";
         }
-        break;
-    case (NODE_INTERNAL):
-        num_keys = *internal_node_num_keys(node);
-        indent(indentation_level);
-        printf("- internal (size %d)\n", num_keys);
-        if (num_keys > 0)
+        if (error == NULL && has_high && num_cells > 0 && *leaf_node_key(node, num_cells - 1) != high)
+            error = "separator is not the leaf's largest key";
+        if (error == NULL)
         {
-            for (uint32_t i = 0; i < num_keys; i++)
+            if (check->num_leaves == check->leaves_capacity)
             {
-                child = *internal_node_child(node, i);
-                print_tree(pager, child, indentation_level + 1);
-
-                indent(indentation_level + 1);
-                printf("- key %d\n", *internal_node_key(node, i));
+                check->leaves_capacity = check->leaves_capacity ? 2 * check->leaves_capacity : 1024;
+                check->leaves = realloc(check->leaves, check->leaves_capacity * sizeof(uint64_t));
             }
-            child = *internal_node_right_child(node);
-            print_tree(pager, child, indentation_level + 1);
+            check->leaves[check->num_leaves++] = page_num;
+            check->rows += num_cells;
         }
-        else
+    }
+    else
+    {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint64_t children[INTERNAL_NODE_MAX_CELLS + 1];
+        uint64_t keys[INTERNAL_NODE_MAX_CELLS];
+        if (num_keys == 0 || num_keys > INTERNAL_NODE_MAX_CELLS)
+            error = "bad key count";
+        else if (depth + 1 >= TABLE_MAX_DEPTH)
+            error = "tree too deep";
+        for (uint32_t i = 0; error == NULL && i < num_keys; i++)
         {
-            /* empty internal node: nothing to print */
+            children[i] = *internal_node_child(node, i);
+            keys[i] = *internal_node_key(node, i);
+            if ((i > 0 && keys[i] <= keys[i - 1]) || (i == 0 && has_low && keys[i] <= low) ||
+                (has_high && keys[i] >= high))
+                error = "separator out of order";
+        }
+        if (error == NULL)
+        {
+            children[num_keys] = *internal_node_right_child(node);
+            for (uint32_t i = 0; i <= num_keys && check->error == NULL; i++)
+            {
+                pager_unpin_all(check->pager);
+                bool child_has_low = i > 0 || has_low;
+                uint64_t child_low = i > 0 ? keys[i - 1] : low;
+                if (i < num_keys)
+                    tree_check_node(check, children[i], depth + 1, child_has_low, child_low, true, keys[i]);
+                else
+                    tree_check_node(check, children[i], depth + 1, child_has_low, child_low, has_high, high);
+            }
         }
-        break;
+    }
+    if (error != NULL && check->error == NULL)
+    {
+        check->error = error;
+        check->error_page_num = page_num;
     }
 }
 
-/* --- meta commands / statement preparation / execute --- */
-metacommandresult do_meta_command(inputbuffer *input_buffer, table *table)
+/* Check the whole tree, the leaf chain against key order, and that it holds
+   exactly the ids the stress test inserted. */
+bool tree_check(table *table, uint64_t num_rows, treecheck *check)
 {
-    if (strcmp(input_buffer->buffer, ".exit") == 0)
-    {
-        close_input_buffer(input_buffer);
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    }
-    else if (strcmp(input_buffer->buffer, ".constants") == 0)
+    memset(check, 0, sizeof(*check));
+    check->pager = table->pager;
+    tree_check_node(check, table->root_page_num, 0, false, 0, false, 0);
+
+    for (uint64_t i = 0; check->error == NULL && i < check->num_leaves; i++)
     {
-        printf("Constants:\n");
-        return META_COMMAND_SUCCESS;
+        uint64_t next = *leaf_node_next_leaf(get_page(check->pager, check->leaves[i]));
+        pager_unpin_all(check->pager);
+        if (next != (i + 1 < check->num_leaves ? check->leaves[i + 1] : 0))
+        {
+            check->error = "leaf chain out of key order";
+            check->error_page_num = check->leaves[i];
+        }
     }
-    else if (strcmp(input_buffer->buffer, ".btree") == 0)
+    if (check->error == NULL && check->rows != num_rows)
     {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
+        check->error = "wrong number of rows";
+        check->error_page_num = table->root_page_num;
     }
-    else
+    for (uint64_t i = 0; check->error == NULL && i < num_rows; i++)
     {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+        cursor cursor;
+        table_find(table, stress_id(i), &cursor);
+        void *node = get_page(check->pager, cursor.page_num);
+        if (cursor.cell_num >= *leaf_node_num_cells(node) || *leaf_node_key(node, cursor.cell_num) != stress_id(i))
+        {
+            check->error = "inserted id not found";
+            check->error_page_num = cursor.page_num;
+        }
+        pager_unpin_all(check->pager);
     }
+    free(check->leaves);
+    return check->error == NULL;
 }
 
-prepareresult prepare_insert(inputbuffer *input_buffer, statement *statement)
+void stress_run(const char *filename, const dboptions *options, uint64_t num_rows)
 {
-    statement->type = STATEMENT_INSERT;
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
+    dboptions unsharded = *options;
+    unsharded.num_shards = 0;
+    unsharded.shared = false;
+    pthread_t threads[STRESS_MAX_THREADS];
+    stressworker workers[STRESS_MAX_THREADS];
 
-    if (id_string == NULL || username == NULL || email == NULL)
-        return PREPARE_SYNTAX_ERROR;
+    for (uint32_t num_threads = 1; num_threads <= STRESS_MAX_THREADS; num_threads *= 2)
+    {
+        unlink(filename);
+        table *table = db_open(filename, &unsharded);
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, num_threads);
 
-    int id = atoi(id_string);
-    if (id < 0)
-        return PREPARE_NEGATIVE_ID;
-    if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE)
-        return PREPARE_STRING_TOO_LONG;
+        double start = clock_seconds();
+        for (uint32_t t = 0; t < num_threads; t++)
+        {
+            workers[t] = (stressworker){table, &barrier, t, num_threads, num_rows, 0, 0, 0};
+            pthread_create(&threads[t], NULL, stress_writer, &workers[t]);
+        }
+        uint64_t inserted = 0, duplicates = 0, errors = 0;
+        for (uint32_t t = 0; t < num_threads; t++)
+        {
+            pthread_join(threads[t], NULL);
+            inserted += workers[t].inserted;
+            duplicates += workers[t].duplicates;
+            errors += workers[t].errors;
+        }
+        double elapsed = clock_seconds() - start;
+        pthread_barrier_destroy(&barrier);
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+        uint64_t retried = 0;
+        for (uint32_t t = 0; t < num_threads; t++)
+        {
+            uint32_t other = (t + 1) % num_threads;
+            retried += other < num_rows ? (num_rows - other + 10 * (uint64_t)num_threads - 1) / (10 * (uint64_t)num_threads) : 0;
+        }
+        if (inserted != num_rows || duplicates != retried || errors != 0)
+        {
+            printf("%2u threads: %" PRIu64 " inserted, %" PRIu64 " duplicates, %" PRIu64 " errors; expected %" PRIu64
+                   " and %" PRIu64 "\n",
+                   num_threads, inserted, duplicates, errors, num_rows, retried);
+            exit(EXIT_FAILURE);
+        }
 
-    return PREPARE_SUCCESS;
+        /* once as the writers left it, once as it was written to disk */
+        treecheck check;
+        bool ok = tree_check(table, num_rows, &check);
+        if (ok)
+        {
+            db_close(table);
+            table = db_open(filename, &unsharded);
+            ok = tree_check(table, num_rows, &check);
+        }
+        if (!ok)
+        {
+            printf("%2u threads: tree broken at page %" PRIu64 ": %s\n", num_threads, check.error_page_num, check.error);
+            exit(EXIT_FAILURE);
+        }
+        printf("%2u threads: %" PRIu64 " inserts in %.3f s, %.0f inserts/s; tree ok, %u levels, %" PRIu64 " leaves\n",
+               num_threads, num_rows + retried, elapsed, (num_rows + retried) / elapsed, check.leaf_depth,
+               check.num_leaves);
+        db_close(table);
+    }
 }
 
-prepareresult prepare_statement(inputbuffer *input_buffer, statement *statement)
+/* --- Sparse file test --- */
+/* --sparse-test FILE creates a fresh FILE and moves its end SPARSE_TEST_OFFSET
+   bytes in before inserting --rows scattered 64-bit ids, so every page the
+   inserts allocate lies past 4 GiB and the file system leaves a hole before
+   them. The tree is checked, then checked again after the file is reopened. */
+#define SPARSE_TEST_OFFSET (6ull << 30)
+
+void sparse_test_run(const char *filename, const dboptions *options, uint64_t num_rows)
 {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0)
-        return prepare_insert(input_buffer, statement);
-    if (strcmp(input_buffer->buffer, "select") == 0)
+    dboptions unsharded = *options;
+    unsharded.num_shards = 0;
+    unsharded.shared = false;
+    unlink(filename);
+    table *table = db_open(filename, &unsharded);
+    uint64_t first_page_num = SPARSE_TEST_OFFSET / table->pager->page_size;
+    table->pager->num_pages = first_page_num;
+
+    for (uint64_t i = 0; i < num_rows; i++)
     {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        row row = {0};
+        row.id = stress_id(i);
+        snprintf(row.username, sizeof(row.username), "user%" PRIu64, i);
+        snprintf(row.email, sizeof(row.email), "user%" PRIu64 "@example.com", i);
+        if (table_insert_row(table, &row) != EXECUTE_SUCCESS)
+        {
+            printf("Insert of id %" PRIu64 " failed.\n", row.id);
+            exit(EXIT_FAILURE);
+        }
     }
-    return PREPARE_URECOGNISED_STATEMENT;
-}
 
-executeresult execute_select(statement *statement, table *table)
-{
-    cursor *c = table_start(table);
-    row row;
-    while (!c->end_of_table)
+    treecheck check;
+    bool ok = tree_check(table, num_rows, &check);
+    if (ok)
+    {
+        db_close(table);
+        table = db_open(filename, &unsharded);
+        ok = tree_check(table, num_rows, &check);
+    }
+    if (!ok)
     {
-        deserialize_row(cursor_value(c), &row);
-        print_row(&row);
-        cursor_advance(c);
+        printf("Tree broken at page %" PRIu64 ": %s\n", check.error_page_num, check.error);
+        exit(EXIT_FAILURE);
     }
-    free(c);
-    return EXECUTE_SUCCESS;
+    if (table->pager->num_pages <= first_page_num)
+    {
+        printf("No page was written past %" PRIu64 " bytes; use more --rows.\n", (uint64_t)SPARSE_TEST_OFFSET);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat status;
+    fstat(table->pager->file_descriptor, &status);
+    printf("%" PRIu64 " rows in %" PRIu64 " leaves, %u levels, up to page %" PRIu64 "; file is %.2f GiB with %.1f MiB "
+           "allocated; tree ok after reopening\n",
+           num_rows, check.num_leaves, check.leaf_depth, table->pager->num_pages - 1,
+           (double)status.st_size / (1 << 30), (double)status.st_blocks * 512 / (1 << 20));
+    db_close(table);
 }
+#endif
 
-executeresult execute_insert(statement *statement, table *table)
+/* --- main --- */
+int main(int argc, char *argv[])
 {
-    void *node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-    if (num_cells >= LEAF_NODE_MAX_CELLS)
-        return EXECUTE_TABLE_FULL;
+    dboptions options = {0};
+    char *filename = NULL;
+    char *socket_path = NULL;
+    int tcp_port = 0;
+    char *loadgen_target = NULL;
+    uint32_t loadgen_clients = 8, loadgen_requests = 10000, loadgen_pipeline = 64;
+    char *stress_path = NULL;
+    uint64_t stress_rows = 100000;
+    char *sparse_test_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--direct") == 0)
+            options.direct_io = true;
+        else if (strcmp(argv[i], "--pax") == 0)
+            options.leaf_layout = LEAF_LAYOUT_PAX;
+        else if (strcmp(argv[i], "--dict-emails") == 0)
+            options.leaf_layout = LEAF_LAYOUT_DICT;
+        else if (strcmp(argv[i], "--shards") == 0 && has_value)
+            options.num_shards = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--page-size") == 0 && has_value)
+            options.page_size = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--writer-rate") == 0 && has_value)
+            options.writer_rate = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dirty-high-water") == 0 && has_value)
+            options.dirty_high_water = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--row-cache") == 0 && has_value)
+            options.row_cache_rows = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--shared") == 0)
+            options.shared = true;
+        else if (strcmp(argv[i], "--listen") == 0 && has_value)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "--tcp") == 0 && has_value)
+            tcp_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--loadgen") == 0 && has_value)
+            loadgen_target = argv[++i];
+        else if (strcmp(argv[i], "--clients") == 0 && has_value)
+            loadgen_clients = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--requests") == 0 && has_value)
+            loadgen_requests = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--pipeline") == 0 && has_value)
+            loadgen_pipeline = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stress") == 0 && has_value)
+            stress_path = argv[++i];
+        else if (strcmp(argv[i], "--sparse-test") == 0 && has_value)
+            sparse_test_path = argv[++i];
+        else if (strcmp(argv[i], "--rows") == 0 && has_value)
+            stress_rows = strtoull(argv[++i], NULL, 10);
+        else
+            filename = argv[i];
+    }
 
-    row *row_to_insert = &statement->row_to_insert;
-    uint32_t key_to_insert = row_to_insert->id;
-    cursor *cursor = table_find(table, key_to_insert);
+    if (options.page_size != 0 && !page_size_valid(options.page_size))
+    {
+        printf("Page size must be a power of two from %d to %d.\n", PAGE_SIZE_MIN, PAGE_SIZE_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (options.dirty_high_water > 100)
+    {
+        printf("--dirty-high-water is a percentage of the page cache.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.shared && options.writer_rate > 0)
+    {
+        printf("--writer-rate cannot be used with --shared; the shared cache writes pages back.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (cursor->cell_num < num_cells)
+    if (stress_path != NULL)
     {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert)
-        {
-            free(cursor);
-            return EXECUTE_DUPLICATE_KEY;
-        }
+#ifdef __linux__
+        stress_run(stress_path, &options, stress_rows);
+        return 0;
+#else
+        printf("The stress test needs Linux.\n");
+        exit(EXIT_FAILURE);
+#endif
     }
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-    free(cursor);
-    return EXECUTE_SUCCESS;
-}
 
-executeresult execute_statement(statement *statement, table *table)
-{
-    switch (statement->type)
+    if (sparse_test_path != NULL)
     {
-    case STATEMENT_INSERT:
-        return execute_insert(statement, table);
-    case STATEMENT_SELECT:
-        return execute_select(statement, table);
-    default:
-        return EXECUTE_SUCCESS;
+#ifdef __linux__
+        sparse_test_run(sparse_test_path, &options, stress_rows);
+        return 0;
+#else
+        printf("The sparse file test needs Linux.\n");
+        exit(EXIT_FAILURE);
+#endif
     }
-}
 
-/* --- main --- */
-int main(int argc, char *argv[])
-{
-    if (argc < 2)
+    if (loadgen_target != NULL || socket_path != NULL || tcp_port > 0)
+    {
+#ifdef __linux__
+        if (loadgen_target != NULL)
+        {
+            if (loadgen_clients == 0 || loadgen_pipeline == 0)
+            {
+                printf("--clients and --pipeline must be positive.\n");
+                exit(EXIT_FAILURE);
+            }
+            loadgen_run(loadgen_target, loadgen_clients, loadgen_requests, loadgen_pipeline);
+            return 0;
+        }
+        if (filename == NULL)
+        {
+            printf("Must supply a database filename.\n");
+            exit(EXIT_FAILURE);
+        }
+        table *table = db_open(filename, &options);
+        server_run(table, socket_path, tcp_port);
+        db_close(table);
+        return 0;
+#else
+        printf("Server mode needs Linux.\n");
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    if (filename == NULL)
     {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    char *filename = argv[1];
-    table *table = db_open(filename);
+    table *table = db_open(filename, &options);
     inputbuffer *input_buffer = new_input_buffer();
+    programcache *programs = program_cache_open();
 
     while (true)
     {
+        /* a running vacuum gets one slice per command and the idle time between commands */
+        if (vacuum_step(table))
+            while (!input_pending() && vacuum_step(table))
+                ;
         print_prompt();
         read_input(input_buffer);
 
         if (input_buffer->buffer[0] == '.')
         {
-            switch (do_meta_command(input_buffer, table))
+            table_shared_begin(table, false);
+            metacommandresult meta_result = do_meta_command(input_buffer, table);
+            table_shared_end(table);
+            switch (meta_result)
             {
             case META_COMMAND_SUCCESS:
                 continue;
@@ -1134,7 +7339,8 @@ int main(int argc, char *argv[])
         }
 
         statement statement;
-        switch (prepare_statement(input_buffer, &statement))
+        double parse_started = clock_seconds();
+        switch (prepare_statement(input_buffer, &statement, programs))
         {
         case PREPARE_SUCCESS:
             break;
@@ -1152,7 +7358,19 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        switch (execute_statement(&statement, table))
+        if (statement.list_program)
+        {
+            print_program(programs, statement.program);
+            continue;
+        }
+        table_shared_begin(table, statement.type == STATEMENT_INSERT);
+        executeresult result = statement.explain
+                                   ? explain_statement(&statement, table, clock_seconds() - parse_started)
+                                   : execute_statement(&statement, table);
+        table_shared_end(table);
+        if (statement.type == STATEMENT_INSERT)
+            free(statement.rows_to_insert);
+        switch (result)
         {
         case EXECUTE_SUCCESS:
             printf("Executed.\n");
@@ -1163,6 +7381,9 @@ int main(int argc, char *argv[])
         case EXECUTE_DUPLICATE_KEY:
             printf("Error: Duplicate key.\n");
             break;
+        case EXECUTE_EMAIL_NOT_STORABLE:
+            printf("Error: Email too long for a dictionary leaf.\n");
+            break;
         }
     }
     return 0;